@@ -0,0 +1,544 @@
+#define _POSIX_C_SOURCE 200809L // getopt
+#include "chip8.c"
+#include "cfg.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// chip8-analyze: finds the basic blocks of a ROM the way chip8-aot compiles
+// them, connects them with the jumps, skips, calls and returns between them,
+// and tells code from sprites by following the values of I to the DXYN that
+// draw them. Prints an annotated disassembly, or with -m a block map:
+//
+//   block <start> <end> <instructions> <successor>...
+//   sprite <start> <end>
+//   data <start> <end>
+//
+// Addresses are hex and ends exclusive. A successor is kind:address with kind
+// next (fall through or skip not taken), skip, jump, call or return, or
+// indirect for a BNNN whose V0 is not known. data is memory read or written by
+// FX33, FX55 and FX65. chip8-aot -m takes the map to compile extra blocks.
+
+#define ANALYZE_CODE 1
+#define ANALYZE_SPRITE 2
+#define ANALYZE_DATA 4
+
+#define ANALYZE_MAX_I 8 // values of I tracked at once, more count as unknown
+#define ANALYZE_MAX_EDGES (1 << 16)
+
+enum edge_kind {
+  EDGE_NEXT,
+  EDGE_SKIP,
+  EDGE_JUMP,
+  EDGE_CALL,
+  EDGE_RETURN,
+};
+
+char *edge_kind_names[] = {"next", "skip", "jump", "call", "return"};
+
+struct edge {
+  uint16_t from; // block start
+  uint16_t to;
+  enum edge_kind kind;
+};
+
+// The values I can have at some point.
+struct i_values {
+  bool is_set; // false until a path reaches it
+  bool is_unknown;
+  uint8_t len;
+  uint16_t values[ANALYZE_MAX_I];
+};
+
+struct analysis {
+  struct cfg cfg;
+  uint8_t kind[CHIP8_MEMORY_SIZE]; // ANALYZE_ bits for every byte
+  bool is_indirect[CHIP8_MEMORY_SIZE]; // block ends in a BNNN that was not resolved
+  struct edge edges[ANALYZE_MAX_EDGES];
+  size_t edges_len;
+  struct i_values i_at[CHIP8_MEMORY_SIZE]; // at the start of each block
+  uint16_t worklist[CHIP8_MEMORY_SIZE];
+  bool is_queued[CHIP8_MEMORY_SIZE];
+  size_t worklist_len;
+};
+
+void die(char *s) {
+  perror(s);
+  exit(1);
+}
+
+size_t read_file(char *file, uint8_t *buffer, size_t buffer_len) {
+  FILE *f = fopen(file, "r");
+  if (f == NULL) {
+    die("fopen");
+  }
+  size_t bytes_read = fread(buffer, sizeof *buffer, buffer_len, f);
+  if (!feof(f)) {
+    die("fread");
+  }
+  if (fclose(f) != 0) {
+    die("fclose");
+  }
+  return bytes_read;
+}
+
+void analyze_add_edge(struct analysis *a, uint16_t from, uint16_t to, enum edge_kind kind) {
+  if (a->edges_len == ANALYZE_MAX_EDGES) {
+    fprintf(stderr, "too many edges\n");
+    exit(1);
+  }
+  a->edges[a->edges_len++] = (struct edge){from, to & (CHIP8_MEMORY_SIZE - 1), kind};
+}
+
+// The instruction that ends the block at start, or false if it runs into the
+// next block or into bytes that are not an instruction.
+bool analyze_last(struct analysis *a, uint16_t start, uint16_t *address, enum opcode *op) {
+  uint16_t end;
+  size_t count;
+  if (cfg_block_extent(&a->cfg, start, &end, &count) || count == 0) {
+    return false;
+  }
+  *address = end - 2;
+  return cfg_decode(a->cfg.memory[*address], a->cfg.memory[*address + 1], op) && cfg_ends_block(*op);
+}
+
+// Edges out of every block but the returns, which need the calls first.
+void analyze_edges(struct analysis *a) {
+  for (size_t start = 0; start < CHIP8_MEMORY_SIZE; start++) {
+    if (!a->cfg.is_block_start[start]) {
+      continue;
+    }
+    uint16_t end;
+    size_t count;
+    if (cfg_block_extent(&a->cfg, start, &end, &count)) {
+      analyze_add_edge(a, start, end, EDGE_NEXT);
+      continue;
+    }
+    uint16_t address;
+    enum opcode op;
+    if (!analyze_last(a, start, &address, &op)) {
+      continue;
+    }
+    uint8_t b1 = a->cfg.memory[address];
+    uint8_t b2 = a->cfg.memory[address + 1];
+    uint16_t nnn = ((b1 & 0xf) << 8) | b2;
+    switch (op) {
+      case OP_1NNN:
+        analyze_add_edge(a, start, nnn, EDGE_JUMP);
+        break;
+      case OP_2NNN:
+        analyze_add_edge(a, start, nnn, EDGE_CALL);
+        break;
+      case OP_BNNN: {
+        // V0 as cfg_discover() sees it, within the block
+        int v0 = -1;
+        for (uint16_t at = start; at < address; at += 2) {
+          enum opcode at_op;
+          cfg_decode(a->cfg.memory[at], a->cfg.memory[at + 1], &at_op);
+          if (at_op == OP_6XNN && (a->cfg.memory[at] & 0xf) == 0) {
+            v0 = a->cfg.memory[at + 1];
+          } else if (cfg_writes_v0(at_op, a->cfg.memory[at] & 0xf)) {
+            v0 = -1;
+          }
+        }
+        if (v0 >= 0) {
+          analyze_add_edge(a, start, nnn + v0, EDGE_JUMP);
+        } else {
+          a->is_indirect[start] = true;
+        }
+        break;
+      }
+      case OP_00EE:
+        break;
+      default:
+        if (cfg_is_skip(op)) {
+          analyze_add_edge(a, start, end, EDGE_NEXT);
+          analyze_add_edge(a, start, end + 2, EDGE_SKIP);
+        } else {
+          analyze_add_edge(a, start, end, EDGE_NEXT); // FX0A, FX33, FX55
+        }
+    }
+  }
+}
+
+// Connects the 00EE reachable from each subroutine to the instructions after
+// the calls to it. Code shared by several subroutines returns to all of them.
+void analyze_returns(struct analysis *a) {
+  static bool is_seen[CHIP8_MEMORY_SIZE];
+  static uint16_t stack[CHIP8_MEMORY_SIZE];
+  size_t call_edges = a->edges_len;
+  for (size_t c = 0; c < call_edges; c++) {
+    if (a->edges[c].kind != EDGE_CALL) {
+      continue;
+    }
+    uint16_t entry = a->edges[c].to;
+    // every subroutine once, from its first call
+    bool is_first = true;
+    for (size_t prev = 0; prev < c; prev++) {
+      if (a->edges[prev].kind == EDGE_CALL && a->edges[prev].to == entry) {
+        is_first = false;
+      }
+    }
+    if (!is_first || !a->cfg.is_block_start[entry]) {
+      continue;
+    }
+
+    memset(is_seen, 0, sizeof is_seen);
+    size_t stack_len = 0;
+    stack[stack_len++] = entry;
+    is_seen[entry] = true;
+    while (stack_len > 0) {
+      uint16_t start = stack[--stack_len];
+      uint16_t address;
+      enum opcode op;
+      if (analyze_last(a, start, &address, &op) && op == OP_00EE) {
+        for (size_t call = 0; call < call_edges; call++) {
+          if (a->edges[call].kind == EDGE_CALL && a->edges[call].to == entry) {
+            uint16_t call_end;
+            size_t count;
+            cfg_block_extent(&a->cfg, a->edges[call].from, &call_end, &count);
+            analyze_add_edge(a, start, call_end, EDGE_RETURN);
+          }
+        }
+        continue;
+      }
+      // stay in the subroutine: a call inside it comes back to the next block
+      for (size_t e = 0; e < call_edges; e++) {
+        struct edge *edge = &a->edges[e];
+        if (edge->from != start) {
+          continue;
+        }
+        uint16_t to = edge->to;
+        if (edge->kind == EDGE_CALL) {
+          size_t count;
+          cfg_block_extent(&a->cfg, start, &to, &count);
+        }
+        if (a->cfg.is_block_start[to] && !is_seen[to]) {
+          is_seen[to] = true;
+          stack[stack_len++] = to;
+        }
+      }
+    }
+  }
+}
+
+// Merges values into the values at the start of the block at address, and
+// returns whether they changed.
+bool analyze_merge(struct analysis *a, uint16_t address, struct i_values *values) {
+  struct i_values *into = &a->i_at[address];
+  bool changed = !into->is_set;
+  into->is_set = true;
+  if (into->is_unknown) {
+    return changed;
+  }
+  if (values->is_unknown) {
+    into->is_unknown = true;
+    return true;
+  }
+  for (size_t v = 0; v < values->len; v++) {
+    bool found = false;
+    for (size_t w = 0; w < into->len; w++) {
+      found |= into->values[w] == values->values[v];
+    }
+    if (found) {
+      continue;
+    }
+    if (into->len == ANALYZE_MAX_I) {
+      into->is_unknown = true;
+      return true;
+    }
+    into->values[into->len++] = values->values[v];
+    changed = true;
+  }
+  return changed;
+}
+
+void analyze_mark(struct analysis *a, struct i_values *values, size_t len, uint8_t kind) {
+  for (size_t v = 0; !values->is_unknown && v < values->len; v++) {
+    for (size_t b = 0; b < len; b++) {
+      a->kind[(values->values[v] + b) & (CHIP8_MEMORY_SIZE - 1)] |= kind;
+    }
+  }
+}
+
+// Runs the block at start on the values of I at its start, marking what DXYN,
+// FX33, FX55 and FX65 use when mark is set. Leaves the values at the end.
+void analyze_block_i(struct analysis *a, uint16_t start, struct i_values *values, bool mark) {
+  uint16_t end;
+  size_t count;
+  cfg_block_extent(&a->cfg, start, &end, &count);
+  for (uint16_t address = start; count > 0; address += 2, count--) {
+    uint8_t b1 = a->cfg.memory[address];
+    uint8_t b2 = a->cfg.memory[address + 1];
+    uint8_t x = b1 & 0xf;
+    enum opcode op;
+    cfg_decode(b1, b2, &op);
+    switch (op) {
+      case OP_ANNN:
+        values->is_unknown = false;
+        values->len = 1;
+        values->values[0] = ((b1 & 0xf) << 8) | b2;
+        break;
+      case OP_FX1E:
+      case OP_FX29:
+        values->is_unknown = true;
+        break;
+      case OP_DXYN:
+        if (mark) {
+          analyze_mark(a, values, b2 & 0xf, ANALYZE_SPRITE);
+        }
+        break;
+      case OP_FX33:
+        if (mark) {
+          analyze_mark(a, values, 3, ANALYZE_DATA);
+        }
+        break;
+      case OP_FX55:
+      case OP_FX65:
+        if (mark) {
+          analyze_mark(a, values, x + 1, ANALYZE_DATA);
+        }
+        for (size_t v = 0; v < values->len; v++) {
+          values->values[v] = (values->values[v] + x + 1) & 0xffff;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+// Follows the values of I through the blocks until they stop changing, then
+// marks the memory the instructions using I read and write.
+void analyze_data(struct analysis *a) {
+  struct i_values values = {.is_set = true, .len = 1, .values = {0}}; // chip8_init() leaves I at 0
+  analyze_merge(a, PROGRAM_START_ADDRESS, &values);
+  a->worklist[a->worklist_len++] = PROGRAM_START_ADDRESS;
+  a->is_queued[PROGRAM_START_ADDRESS] = true;
+  while (a->worklist_len > 0) {
+    uint16_t start = a->worklist[--a->worklist_len];
+    a->is_queued[start] = false;
+    values = a->i_at[start];
+    analyze_block_i(a, start, &values, false);
+    for (size_t e = 0; e < a->edges_len; e++) {
+      uint16_t to = a->edges[e].to;
+      if (a->edges[e].from == start && a->cfg.is_block_start[to] && analyze_merge(a, to, &values) && !a->is_queued[to]) {
+        a->is_queued[to] = true;
+        a->worklist[a->worklist_len++] = to;
+      }
+    }
+  }
+
+  for (size_t start = 0; start < CHIP8_MEMORY_SIZE; start++) {
+    if (a->cfg.is_block_start[start] && a->i_at[start].is_set) {
+      values = a->i_at[start];
+      analyze_block_i(a, start, &values, true);
+    }
+  }
+  for (size_t address = 0; address + 1 < CHIP8_MEMORY_SIZE; address++) {
+    enum opcode op;
+    if (a->cfg.is_visited[address] && cfg_decode(a->cfg.memory[address], a->cfg.memory[address + 1], &op)) {
+      a->kind[address] |= ANALYZE_CODE;
+      a->kind[address + 1] |= ANALYZE_CODE;
+    }
+  }
+}
+
+// Where the listing and the map end: the end of the program or of the last block.
+size_t analyze_end(struct analysis *a) {
+  size_t end = a->cfg.program_end;
+  for (size_t address = 0; address < CHIP8_MEMORY_SIZE; address++) {
+    if (a->cfg.is_visited[address] && address + 2 > end) {
+      end = address + 2;
+    }
+  }
+  return end;
+}
+
+void analyze_print_ranges(struct analysis *a, uint8_t kind, char *name) {
+  for (size_t address = 0; address < CHIP8_MEMORY_SIZE; address++) {
+    if (!(a->kind[address] & kind)) {
+      continue;
+    }
+    size_t end = address;
+    while (end < CHIP8_MEMORY_SIZE && (a->kind[end] & kind)) {
+      end++;
+    }
+    printf("%s %03zx %03zx\n", name, address, end);
+    address = end;
+  }
+}
+
+void analyze_print_map(struct analysis *a, char *file) {
+  printf("# chip8-analyze block map of %s\n", file);
+  for (size_t start = 0; start < CHIP8_MEMORY_SIZE; start++) {
+    if (!a->cfg.is_block_start[start]) {
+      continue;
+    }
+    uint16_t end;
+    size_t count;
+    cfg_block_extent(&a->cfg, start, &end, &count);
+    printf("block %03zx %03x %zu", start, end, count);
+    for (size_t e = 0; e < a->edges_len; e++) {
+      if (a->edges[e].from == start) {
+        printf(" %s:%03x", edge_kind_names[a->edges[e].kind], a->edges[e].to);
+      }
+    }
+    if (a->is_indirect[start]) {
+      printf(" indirect");
+    }
+    printf("\n");
+  }
+  analyze_print_ranges(a, ANALYZE_SPRITE, "sprite");
+  analyze_print_ranges(a, ANALYZE_DATA, "data");
+}
+
+// Prints the header of the block at start: how it is reached.
+void analyze_print_block(struct analysis *a, uint16_t start) {
+  printf("\n; block %03x", start);
+  if (start == PROGRAM_START_ADDRESS) {
+    printf(", entry");
+  }
+  for (int kind = EDGE_NEXT; kind <= EDGE_RETURN; kind++) {
+    bool first = true;
+    for (size_t e = 0; e < a->edges_len; e++) {
+      if (a->edges[e].to == start && a->edges[e].kind == (enum edge_kind)kind) {
+        if (first) {
+          printf(", %s from", kind == EDGE_CALL ? "called" : edge_kind_names[kind]);
+        }
+        printf(" %03x", a->edges[e].from);
+        first = false;
+      }
+    }
+  }
+  printf("\n");
+}
+
+// Whether the BNNN at address ends a block whose target is not known.
+bool analyze_is_indirect(struct analysis *a, uint16_t address) {
+  for (uint16_t start = address; ; start--) {
+    if (a->cfg.is_block_start[start]) {
+      return a->is_indirect[start];
+    }
+  }
+}
+
+void analyze_print_listing(struct analysis *a, char *file) {
+  size_t blocks = 0;
+  size_t sprite_bytes = 0;
+  size_t data_bytes = 0;
+  for (size_t address = 0; address < CHIP8_MEMORY_SIZE; address++) {
+    blocks += a->cfg.is_block_start[address];
+    sprite_bytes += (a->kind[address] & ANALYZE_SPRITE) != 0;
+    data_bytes += (a->kind[address] & ANALYZE_DATA) != 0;
+  }
+  printf("; %s: %zu blocks, %zu sprite bytes, %zu data bytes\n", file, blocks, sprite_bytes, data_bytes);
+
+  size_t end = analyze_end(a);
+  size_t address = PROGRAM_START_ADDRESS;
+  for (size_t start = 0; start < PROGRAM_START_ADDRESS; start++) {
+    if (a->cfg.is_visited[start]) {
+      address = start; // code in the font area
+      break;
+    }
+  }
+  int section = -1; // kind of the bytes printed last
+  while (address < end) {
+    uint8_t kind = a->kind[address];
+    if (a->cfg.is_block_start[address]) {
+      analyze_print_block(a, address);
+      section = ANALYZE_CODE;
+    }
+
+    enum opcode op;
+    if (a->cfg.is_visited[address] && cfg_decode(a->cfg.memory[address], a->cfg.memory[address + 1], &op)) {
+      struct instruction instr = {{a->cfg.memory[address], a->cfg.memory[address + 1]}, op};
+      char text[32];
+      chip8_disassemble(&instr, text, sizeof text);
+      uint16_t nnn = ((instr.value[0] & 0xf) << 8) | instr.value[1];
+      char *comment = NULL;
+      if (op == OP_ANNN && (a->kind[nnn] & ANALYZE_SPRITE)) {
+        comment = "sprite";
+      } else if (op == OP_ANNN && (a->kind[nnn] & ANALYZE_DATA)) {
+        comment = "data";
+      } else if (op == OP_BNNN && analyze_is_indirect(a, address)) {
+        comment = "indirect";
+      }
+      if (comment != NULL) {
+        printf("%03zx  %02x%02x  %-16s; %s\n", address, instr.value[0], instr.value[1], text, comment);
+      } else {
+        printf("%03zx  %02x%02x  %s\n", address, instr.value[0], instr.value[1], text);
+      }
+      address += 2;
+      continue;
+    }
+
+    // sprites as pixels, everything else as bytes
+    if (kind & ANALYZE_SPRITE) {
+      if (section != ANALYZE_SPRITE) {
+        printf("\n; sprite\n");
+        section = ANALYZE_SPRITE;
+      }
+      printf("%03zx  %02x    ", address, a->cfg.memory[address]);
+      for (int bit = 7; bit >= 0; bit--) {
+        putchar((a->cfg.memory[address] >> bit) & 1 ? '#' : '.');
+      }
+      printf("\n");
+      address++;
+      continue;
+    }
+    uint8_t byte_kind = kind & ANALYZE_DATA ? ANALYZE_DATA : 0;
+    if (section != byte_kind) {
+      printf(byte_kind ? "\n; data\n" : "\n; not reached\n");
+      section = byte_kind;
+    }
+    printf("%03zx ", address);
+    for (int n = 0; n < 8 && address < end; n++, address++) {
+      uint8_t next_kind = a->kind[address] & ANALYZE_DATA ? ANALYZE_DATA : 0;
+      if (n > 0 && (a->cfg.is_block_start[address] || a->cfg.is_visited[address] ||
+          (a->kind[address] & ANALYZE_SPRITE) || next_kind != byte_kind)) {
+        break;
+      }
+      printf(" %02x", a->cfg.memory[address]);
+    }
+    printf("\n");
+  }
+}
+
+int main(int argc, char **argv) {
+  bool map = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "m")) != -1) {
+    switch (opt) {
+      case 'm':
+        map = true;
+        break;
+      default:
+        fprintf(stderr, "usage: chip8-analyze [-m] program\n");
+        exit(1);
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "specify a program to analyze\n");
+    exit(1);
+  }
+  char *file = argv[optind];
+
+  static struct analysis a;
+  memcpy(a.cfg.memory, font, sizeof(font));
+  size_t len = read_file(file, &a.cfg.memory[PROGRAM_START_ADDRESS], (sizeof a.cfg.memory) - PROGRAM_START_ADDRESS);
+  a.cfg.program_end = PROGRAM_START_ADDRESS + len;
+
+  cfg_discover(&a.cfg);
+  analyze_edges(&a);
+  analyze_returns(&a);
+  analyze_data(&a);
+
+  if (map) {
+    analyze_print_map(&a, file);
+  } else {
+    analyze_print_listing(&a, file);
+  }
+  return 0;
+}
@@ -0,0 +1,398 @@
+#define _POSIX_C_SOURCE 200809L // getopt
+#include "chip8.c"
+#include "cfg.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// chip8-aot: compiles a ROM to a C file with one labeled straight-line block
+// per basic block reachable from PROGRAM_START_ADDRESS. The output is meant to
+// be included after chip8.c by a frontend built with -DCHIP8_AOT='"file.c"'.
+// It defines:
+//
+//   bool <prefix>_matches(struct chip8 *chip8);
+//     whether the loaded program is the one that was compiled
+//   int <prefix>_run_frame(struct chip8 *chip8, bool *redraw);
+//     runs one frame like the cycle() loop in the frontends and stops at the
+//     same instruction; returns how many instructions ran
+//
+// Jumps that cannot be resolved statically (00EE, BNNN with an unknown V0) go
+// through a switch on pc, and addresses without a block, blocks whose bytes
+// were overwritten and blocks that do not fit in what is left of the frame are
+// run one instruction at a time by cycle().
+
+void die(char *s) {
+  perror(s);
+  exit(1);
+}
+
+size_t read_file(char *file, uint8_t *buffer, size_t buffer_len) {
+  FILE *f = fopen(file, "r");
+  if (f == NULL) {
+    die("fopen");
+  }
+  size_t bytes_read = fread(buffer, sizeof *buffer, buffer_len, f);
+  if (!feof(f)) {
+    die("fread");
+  }
+  if (fclose(f) != 0) {
+    die("fclose");
+  }
+  return bytes_read;
+}
+
+// Continue at a static address: straight to its block, or through dispatch.
+void aot_emit_goto(struct cfg *cfg, FILE *out, char *indent, size_t address) {
+  if (address < sizeof cfg->memory && cfg->is_block_start[address]) {
+    fprintf(out, "%sCHIP8_AOT_GOTO(0x%03zx, b%03zx);\n", indent, address, address);
+  } else {
+    fprintf(out, "%schip8->pc = 0x%03zx;\n%sgoto dispatch;\n", indent, address & 0xffff, indent);
+  }
+}
+
+void aot_emit_skip(struct cfg *cfg, FILE *out, uint16_t address, char *condition) {
+  fprintf(out, "  if (%s) {\n", condition);
+  aot_emit_goto(cfg, out, "    ", address + 4);
+  fprintf(out, "  }\n");
+  aot_emit_goto(cfg, out, "  ", address + 2);
+}
+
+// Emits what one instruction does, mirroring cycle(). Returns false if it ended the block.
+bool aot_emit_operation(struct cfg *cfg, FILE *out, uint16_t address, enum opcode op, int v0) {
+  uint8_t b1 = cfg->memory[address];
+  uint8_t b2 = cfg->memory[address + 1];
+  uint16_t nnn = ((b1 & 0xf) << 8) | b2;
+  uint8_t x = b1 & 0xf;
+  uint8_t y = b2 >> 4;
+  uint8_t n = b2 & 0xf;
+  char condition[128];
+
+  switch (op) {
+    case OP_00E0:
+      fprintf(out, "  memset(chip8->display, 0, sizeof(chip8->display));\n  *redraw = true;\n");
+      return true;
+    case OP_00EE:
+      fprintf(out, "  chip8->pc = chip8->stack[chip8->sp] + 2;\n  chip8->sp++;\n  goto dispatch;\n");
+      return false;
+    case OP_0NNN:
+      return true;
+    case OP_1NNN:
+      aot_emit_goto(cfg, out, "  ", nnn);
+      return false;
+    case OP_2NNN:
+      fprintf(out, "  chip8->sp--;\n  chip8->stack[chip8->sp] = 0x%03x;\n", address);
+      aot_emit_goto(cfg, out, "  ", nnn);
+      return false;
+    case OP_3XNN:
+      snprintf(condition, sizeof condition, "chip8->v[%d] == 0x%02x", x, b2);
+      aot_emit_skip(cfg, out, address, condition);
+      return false;
+    case OP_4XNN:
+      snprintf(condition, sizeof condition, "chip8->v[%d] != 0x%02x", x, b2);
+      aot_emit_skip(cfg, out, address, condition);
+      return false;
+    case OP_5XY0:
+      snprintf(condition, sizeof condition, "chip8->v[%d] == chip8->v[%d]", x, y);
+      aot_emit_skip(cfg, out, address, condition);
+      return false;
+    case OP_6XNN:
+      fprintf(out, "  chip8->v[%d] = 0x%02x;\n", x, b2);
+      return true;
+    case OP_7XNN:
+      fprintf(out, "  chip8->v[%d] += 0x%02x;\n", x, b2);
+      return true;
+    case OP_8XY0:
+      fprintf(out, "  chip8->v[%d] = chip8->v[%d];\n", x, y);
+      return true;
+    case OP_8XY1:
+      fprintf(out, "  chip8->v[%d] |= chip8->v[%d];\n  chip8->v[0xf] = 0;\n", x, y);
+      return true;
+    case OP_8XY2:
+      fprintf(out, "  chip8->v[%d] &= chip8->v[%d];\n  chip8->v[0xf] = 0;\n", x, y);
+      return true;
+    case OP_8XY3:
+      fprintf(out, "  chip8->v[%d] ^= chip8->v[%d];\n  chip8->v[0xf] = 0;\n", x, y);
+      return true;
+    case OP_8XY4:
+      fprintf(out, "  vx = chip8->v[%d];\n  vy = chip8->v[%d];\n", x, y);
+      fprintf(out, "  chip8->v[0xf] = (uint8_t)(vx + vy) < vx;\n  chip8->v[%d] = vx + vy;\n", x);
+      return true;
+    case OP_8XY5:
+      fprintf(out, "  vx = chip8->v[%d];\n  vy = chip8->v[%d];\n", x, y);
+      fprintf(out, "  chip8->v[0xf] = !(vy > vx);\n  chip8->v[%d] = vx - vy;\n", x);
+      return true;
+    case OP_8XY6:
+      fprintf(out, "  vy = chip8->v[%d];\n  chip8->v[%d] = vy >> 1;\n  chip8->v[0xf] = vy & 0x01;\n", y, x);
+      return true;
+    case OP_8XY7:
+      fprintf(out, "  vx = chip8->v[%d];\n  vy = chip8->v[%d];\n", x, y);
+      fprintf(out, "  chip8->v[0xf] = !(vx > vy);\n  chip8->v[%d] = vy - vx;\n", x);
+      return true;
+    case OP_8XYE:
+      fprintf(out, "  vy = chip8->v[%d];\n  chip8->v[%d] = vy << 1;\n  chip8->v[0xf] = (vy & 0x80) != 0;\n", y, x);
+      return true;
+    case OP_9XY0:
+      snprintf(condition, sizeof condition, "chip8->v[%d] != chip8->v[%d]", x, y);
+      aot_emit_skip(cfg, out, address, condition);
+      return false;
+    case OP_ANNN:
+      fprintf(out, "  chip8->i = 0x%03x;\n", nnn);
+      return true;
+    case OP_BNNN:
+      if (v0 >= 0) {
+        aot_emit_goto(cfg, out, "  ", nnn + v0);
+      } else {
+        fprintf(out, "  chip8->pc = 0x%03x + chip8->v[0];\n  goto dispatch;\n", nnn);
+      }
+      return false;
+    case OP_CXNN:
+      fprintf(out, "  chip8->v[%d] = CHIP8_RAND(chip8) & 0x%02x;\n", x, b2);
+      return true;
+    case OP_DXYN:
+      fprintf(out, "  chip8_wait_vblank(chip8);\n");
+      fprintf(out, "  chip8->cycles += %d + %d * ((chip8->v[%d] & 7) ? 26 : 17);\n", 26, n, x);
+      fprintf(out, "  chip8_draw_sprite(chip8, %d, %d, %d);\n  *redraw = true;\n", x, y, n);
+      return true;
+    case OP_EX9E:
+      snprintf(condition, sizeof condition, "chip8_is_key_code_pressed(chip8, chip8->v[%d])", x);
+      aot_emit_skip(cfg, out, address, condition);
+      return false;
+    case OP_EXA1:
+      snprintf(condition, sizeof condition, "!chip8_is_key_code_pressed(chip8, chip8->v[%d])", x);
+      aot_emit_skip(cfg, out, address, condition);
+      return false;
+    case OP_FX07:
+      fprintf(out, "  chip8->v[%d] = chip8_dt(chip8);\n", x);
+      return true;
+    case OP_FX0A:
+      // waiting for a key: cycle() runs it again until the frame is over
+      fprintf(out, "  if (chip8->last_key_released_event == CHIP8_KEY_CODE_NO_KEY || chip8->last_key_released_event == CHIP8_KEY_CODE_EVENT_WANTED) {\n");
+      fprintf(out, "    chip8->last_key_released_event = CHIP8_KEY_CODE_EVENT_WANTED;\n");
+      fprintf(out, "    chip8->pc = 0x%03x;\n", address);
+      fprintf(out, "    while (!chip8_frame_done(chip8, frame_end, executed)) {\n");
+      fprintf(out, "      chip8->cycles += %d;\n      executed++;\n    }\n", chip8_cycle_costs[OP_FX0A]);
+      fprintf(out, "    return executed;\n  }\n");
+      fprintf(out, "  chip8->v[%d] = chip8->last_key_released_event;\n", x);
+      fprintf(out, "  chip8->last_key_released_event = CHIP8_KEY_CODE_NO_KEY;\n");
+      aot_emit_goto(cfg, out, "  ", address + 2);
+      return false;
+    case OP_FX15:
+      fprintf(out, "  chip8_set_dt(chip8, chip8->v[%d]);\n", x);
+      return true;
+    case OP_FX18:
+      fprintf(out, "  chip8_set_st(chip8, chip8->v[%d]);\n", x);
+      return true;
+    case OP_FX1E:
+      fprintf(out, "  chip8->i += chip8->v[%d];\n", x);
+      return true;
+    case OP_FX29:
+      fprintf(out, "  chip8->i = %d;\n", x * 5);
+      return true;
+    case OP_FX33:
+      fprintf(out, "  chip8_store_bcd(chip8, %d);\n", x);
+      aot_emit_goto(cfg, out, "  ", address + 2);
+      return false;
+    case OP_FX55:
+      fprintf(out, "  chip8_store_registers(chip8, %d);\n", x);
+      aot_emit_goto(cfg, out, "  ", address + 2);
+      return false;
+    case OP_FX65:
+      fprintf(out, "  chip8_load_registers(chip8, %d);\n", x);
+      return true;
+  }
+  return true;
+}
+
+// Emits one instruction and its cost, charged after it like cycle() does.
+// Returns false if it ended the block.
+bool aot_emit_instruction(struct cfg *cfg, FILE *out, uint16_t address, enum opcode op, int v0) {
+  fprintf(out, "  // %03x: %02x%02x\n", address, cfg->memory[address], cfg->memory[address + 1]);
+  if (cfg_ends_block(op)) {
+    // none of these look at cycles, so it can go before the jump
+    fprintf(out, "  chip8->cycles += %d;\n", chip8_cycle_costs[op]);
+    return aot_emit_operation(cfg, out, address, op, v0);
+  }
+  aot_emit_operation(cfg, out, address, op, v0);
+  if (chip8_cycle_costs[op] != 0) {
+    fprintf(out, "  chip8->cycles += %d;\n", chip8_cycle_costs[op]);
+  }
+  return true;
+}
+
+void aot_emit_block(struct cfg *cfg, FILE *out, char *prefix, uint16_t start) {
+  size_t count;
+  uint16_t end;
+  bool falls_through = cfg_block_extent(cfg, start, &end, &count);
+
+  uint64_t chunks = 0;
+  if (end > start) {
+    for (size_t chunk = start >> CHIP8_DIRTY_CHUNK_SHIFT; chunk <= (size_t)(end - 1) >> CHIP8_DIRTY_CHUNK_SHIFT; chunk++) {
+      chunks |= (uint64_t)1 << chunk;
+    }
+  }
+
+  fprintf(out, "b%03x:\n", start);
+  if (count == 0) {
+    fprintf(out, "  goto fallback;\n");
+    return;
+  }
+  fprintf(out, "  if ((chip8->written_chunks & 0x%016llxull) && !chip8_memory_equals(chip8, 0x%03x, &%s_memory[0x%03x], %d)) {\n",
+      (unsigned long long)chunks, start, prefix, start, end - start);
+  fprintf(out, "    goto fallback;\n  }\n");
+
+  // The cycle() loop starts an instruction while the frame is not over. With
+  // accurate timing the frame is usually over after a sprite is drawn, and the
+  // rest of the block goes through dispatch, so only the cost up to the first
+  // DXYN, or up to the last instruction, counts.
+  uint64_t cost = 0;
+  for (uint16_t address = start; address + 2 < end; address += 2) {
+    enum opcode op;
+    cfg_decode(cfg->memory[address], cfg->memory[address + 1], &op);
+    if (op == OP_DXYN) {
+      break;
+    }
+    cost += chip8_cycle_costs[op];
+  }
+  fprintf(out, "  if (chip8->accurate_timing ? chip8->cycles + %llu >= frame_end : executed + %zu > CHIP8_INSTRUCTIONS_PER_FRAME) {\n",
+      (unsigned long long)cost, count);
+  fprintf(out, "    goto fallback;\n  }\n");
+  fprintf(out, "  executed += %zu;\n", count);
+
+  int v0 = -1;
+  size_t remaining = count;
+  for (uint16_t address = start; address < end; address += 2) {
+    enum opcode op;
+    uint8_t b1 = cfg->memory[address];
+    uint8_t b2 = cfg->memory[address + 1];
+    cfg_decode(b1, b2, &op);
+    remaining--;
+    if (!aot_emit_instruction(cfg, out, address, op, v0)) {
+      return;
+    }
+    if (op == OP_DXYN && remaining > 0) {
+      fprintf(out, "  if (chip8->accurate_timing) {\n    chip8->pc = 0x%03x;\n    executed -= %zu;\n    goto dispatch;\n  }\n", address + 2, remaining);
+    }
+    if (op == OP_6XNN && (b1 & 0xf) == 0) {
+      v0 = b2;
+    } else if (cfg_writes_v0(op, b1 & 0xf)) {
+      v0 = -1;
+    }
+  }
+  if (falls_through) {
+    aot_emit_goto(cfg, out, "  ", end);
+  } else {
+    // an instruction cycle() has to deal with, if the frame is not over
+    fprintf(out, "  chip8->pc = 0x%03x;\n  goto dispatch;\n", end);
+  }
+}
+
+void aot_emit(struct cfg *cfg, FILE *out, char *file, char *prefix) {
+  fprintf(out, "// generated by chip8-aot from %s, do not edit\n\n", file);
+  fprintf(out, "#ifndef CHIP8_AOT_GOTO\n");
+  fprintf(out, "#define CHIP8_AOT_GOTO(address, label) do { \\\n");
+  fprintf(out, "    chip8->pc = (address); \\\n");
+  fprintf(out, "    if (chip8_frame_done(chip8, frame_end, executed)) { \\\n");
+  fprintf(out, "      return executed; \\\n");
+  fprintf(out, "    } \\\n");
+  fprintf(out, "    goto label; \\\n");
+  fprintf(out, "  } while (0)\n");
+  fprintf(out, "#endif\n\n");
+
+  // memory as compiled, up to the end of the program or the last block
+  size_t memory_end = cfg->program_end;
+  for (size_t address = 0; address < sizeof cfg->memory; address++) {
+    size_t count;
+    uint16_t end;
+    if (cfg->is_block_start[address]) {
+      cfg_block_extent(cfg, address, &end, &count);
+      memory_end = end > memory_end ? end : memory_end;
+    }
+  }
+  fprintf(out, "static const uint8_t %s_memory[] = {", prefix);
+  for (size_t address = 0; address < memory_end; address++) {
+    fprintf(out, "%s0x%02x,", address % 12 == 0 ? "\n  " : " ", cfg->memory[address]);
+  }
+  fprintf(out, "\n};\n\n");
+
+  fprintf(out, "bool %s_matches(struct chip8 *chip8) {\n", prefix);
+  fprintf(out, "  return chip8_memory_equals(chip8, PROGRAM_START_ADDRESS, &%s_memory[PROGRAM_START_ADDRESS], %zu);\n}\n\n",
+      prefix, cfg->program_end - PROGRAM_START_ADDRESS);
+
+  fprintf(out, "int %s_run_frame(struct chip8 *chip8, bool *redraw) {\n", prefix);
+  fprintf(out, "  uint64_t frame_end = chip8_frame_end(chip8);\n");
+  fprintf(out, "  int executed = 0;\n  uint8_t vx, vy;\n  (void)vx;\n  (void)vy;\n\n");
+  fprintf(out, "dispatch:\n  if (chip8_frame_done(chip8, frame_end, executed)) {\n    return executed;\n  }\n  switch (chip8->pc) {\n");
+  for (size_t address = 0; address < sizeof cfg->memory; address++) {
+    if (cfg->is_block_start[address]) {
+      fprintf(out, "    case 0x%03zx: goto b%03zx;\n", address, address);
+    }
+  }
+  fprintf(out, "  }\n\n");
+  fprintf(out, "fallback: {\n  struct cycle_result res;\n  cycle(chip8, &res);\n  *redraw |= res.redraw_needed;\n");
+  fprintf(out, "  executed++;\n  goto dispatch;\n}\n\n");
+
+  for (size_t address = 0; address < sizeof cfg->memory; address++) {
+    if (cfg->is_block_start[address]) {
+      aot_emit_block(cfg, out, prefix, address);
+      fprintf(out, "\n");
+    }
+  }
+  fprintf(out, "}\n");
+}
+
+// Adds the blocks in a block map written by chip8-analyze, for code that
+// cannot be found statically such as the targets of jump tables.
+void aot_read_block_map(struct cfg *cfg, char *file) {
+  FILE *f = fopen(file, "r");
+  if (f == NULL) {
+    die("fopen");
+  }
+  char line[512];
+  while (fgets(line, sizeof line, f) != NULL) {
+    unsigned int start;
+    if (sscanf(line, "block %x", &start) == 1) {
+      cfg_add_block(cfg, start & (CHIP8_MEMORY_SIZE - 1));
+    }
+  }
+  if (ferror(f)) {
+    die("fgets");
+  }
+  fclose(f);
+}
+
+int main(int argc, char **argv) {
+  char *prefix = "chip8_aot";
+  char *map_file = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+    switch (opt) {
+      case 'n':
+        prefix = optarg;
+        break;
+      case 'm':
+        map_file = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: chip8-aot [-n prefix] [-m block map] program\n");
+        exit(1);
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "specify a program to compile\n");
+    exit(1);
+  }
+  char *file = argv[optind];
+
+  static struct cfg cfg;
+  memcpy(cfg.memory, font, sizeof(font));
+  size_t len = read_file(file, &cfg.memory[PROGRAM_START_ADDRESS], (sizeof cfg.memory) - PROGRAM_START_ADDRESS);
+  cfg.program_end = PROGRAM_START_ADDRESS + len;
+
+  if (map_file != NULL) {
+    aot_read_block_map(&cfg, map_file);
+  }
+  cfg_discover(&cfg);
+  aot_emit(&cfg, stdout, file, prefix);
+  return 0;
+}
@@ -0,0 +1,175 @@
+// Basic blocks of a ROM, found by walking every path from
+// PROGRAM_START_ADDRESS. Shared by chip8-aot and chip8-analyze so they agree
+// on where blocks start and end. Include after chip8.c.
+
+struct cfg {
+  uint8_t memory[CHIP8_MEMORY_SIZE];
+  size_t program_end;
+  bool is_block_start[CHIP8_MEMORY_SIZE];
+  bool is_visited[CHIP8_MEMORY_SIZE];
+  uint16_t worklist[CHIP8_MEMORY_SIZE];
+  size_t worklist_len;
+};
+
+// Same decoding as cycle(), but returns false instead of asserting on
+// instructions that do not exist.
+bool cfg_decode(uint8_t b1, uint8_t b2, enum opcode *op) {
+  uint8_t b2lo = b2 & 0xf;
+  switch (b1 >> 4) {
+    case 0x0:
+      *op = b1 == 0x00 && b2 == 0xe0 ? OP_00E0 : b1 == 0x00 && b2 == 0xee ? OP_00EE : OP_0NNN;
+      return true;
+    case 0x1: *op = OP_1NNN; return true;
+    case 0x2: *op = OP_2NNN; return true;
+    case 0x3: *op = OP_3XNN; return true;
+    case 0x4: *op = OP_4XNN; return true;
+    case 0x5: *op = OP_5XY0; return true;
+    case 0x6: *op = OP_6XNN; return true;
+    case 0x7: *op = OP_7XNN; return true;
+    case 0x8:
+      switch (b2lo) {
+        case 0x0: *op = OP_8XY0; return true;
+        case 0x1: *op = OP_8XY1; return true;
+        case 0x2: *op = OP_8XY2; return true;
+        case 0x3: *op = OP_8XY3; return true;
+        case 0x4: *op = OP_8XY4; return true;
+        case 0x5: *op = OP_8XY5; return true;
+        case 0x6: *op = OP_8XY6; return true;
+        case 0x7: *op = OP_8XY7; return true;
+        case 0xe: *op = OP_8XYE; return true;
+        default: return false;
+      }
+    case 0x9: *op = OP_9XY0; return b2lo == 0x0;
+    case 0xa: *op = OP_ANNN; return true;
+    case 0xb: *op = OP_BNNN; return true;
+    case 0xc: *op = OP_CXNN; return true;
+    case 0xd: *op = OP_DXYN; return true;
+    case 0xe:
+      switch (b2) {
+        case 0x9e: *op = OP_EX9E; return true;
+        case 0xa1: *op = OP_EXA1; return true;
+        default: return false;
+      }
+    default:
+      switch (b2) {
+        case 0x07: *op = OP_FX07; return true;
+        case 0x0a: *op = OP_FX0A; return true;
+        case 0x15: *op = OP_FX15; return true;
+        case 0x18: *op = OP_FX18; return true;
+        case 0x1e: *op = OP_FX1E; return true;
+        case 0x29: *op = OP_FX29; return true;
+        case 0x33: *op = OP_FX33; return true;
+        case 0x55: *op = OP_FX55; return true;
+        case 0x65: *op = OP_FX65; return true;
+        default: return false;
+      }
+  }
+}
+
+bool cfg_is_skip(enum opcode op) {
+  return op == OP_3XNN || op == OP_4XNN || op == OP_5XY0 || op == OP_9XY0 || op == OP_EX9E || op == OP_EXA1;
+}
+
+// whether the instruction ends a basic block
+bool cfg_ends_block(enum opcode op) {
+  // memory writes end a block so compiled code after them is checked again
+  return cfg_is_skip(op) || op == OP_00EE || op == OP_1NNN || op == OP_2NNN || op == OP_BNNN ||
+    op == OP_FX0A || op == OP_FX33 || op == OP_FX55;
+}
+
+bool cfg_writes_v0(enum opcode op, uint8_t x) {
+  if (op == OP_FX55) {
+    return false;
+  }
+  if (op == OP_FX65) {
+    return true; // loads V0 to VX
+  }
+  if (op >= OP_8XY1 && op <= OP_8XYE) {
+    return true; // VF is always written, and V0 might be VX
+  }
+  return x == 0 && (op == OP_6XNN || op == OP_7XNN || op == OP_8XY0 || op == OP_CXNN ||
+    op == OP_FX07 || op == OP_FX0A);
+}
+
+void cfg_add_block(struct cfg *cfg, size_t address) {
+  if (address + 1 >= sizeof cfg->memory || cfg->is_block_start[address]) {
+    return;
+  }
+  cfg->is_block_start[address] = true;
+  cfg->worklist[cfg->worklist_len++] = address;
+}
+
+// Walks every path from PROGRAM_START_ADDRESS, and from the blocks added
+// before, to find the block starts.
+void cfg_discover(struct cfg *cfg) {
+  cfg_add_block(cfg, PROGRAM_START_ADDRESS);
+  while (cfg->worklist_len > 0) {
+    uint16_t address = cfg->worklist[--cfg->worklist_len];
+    int v0 = -1; // value of V0 when known from a 6XNN earlier in the run
+
+    for (; (size_t)address + 1 < sizeof cfg->memory && !cfg->is_visited[address]; address += 2) {
+      cfg->is_visited[address] = true;
+      uint8_t b1 = cfg->memory[address];
+      uint8_t b2 = cfg->memory[address + 1];
+      uint16_t nnn = ((b1 & 0xf) << 8) | b2;
+      enum opcode op;
+      if (!cfg_decode(b1, b2, &op)) {
+        break;
+      }
+
+      switch (op) {
+        case OP_1NNN:
+          cfg_add_block(cfg, nnn);
+          break;
+        case OP_2NNN:
+          cfg_add_block(cfg, nnn);
+          cfg_add_block(cfg, address + 2);
+          break;
+        case OP_BNNN:
+          if (v0 >= 0) {
+            cfg_add_block(cfg, nnn + v0);
+          }
+          break;
+        case OP_FX0A:
+        case OP_FX33:
+        case OP_FX55:
+          cfg_add_block(cfg, address + 2);
+          break;
+        default:
+          if (cfg_is_skip(op)) {
+            cfg_add_block(cfg, address + 2);
+            cfg_add_block(cfg, address + 4);
+          }
+      }
+      if (cfg_ends_block(op)) {
+        break;
+      }
+
+      if (op == OP_6XNN && (b1 & 0xf) == 0) {
+        v0 = b2;
+      } else if (cfg_writes_v0(op, b1 & 0xf)) {
+        v0 = -1;
+      }
+    }
+  }
+}
+
+// Returns whether it runs into the next block instead of ending in a jump.
+bool cfg_block_extent(struct cfg *cfg, uint16_t start, uint16_t *end, size_t *count) {
+  *count = 0;
+  for (*end = start; (size_t)*end + 1 < sizeof cfg->memory; *end += 2) {
+    enum opcode op;
+    if (*end != start && cfg->is_block_start[*end]) {
+      return true;
+    }
+    if (!cfg_decode(cfg->memory[*end], cfg->memory[*end + 1], &op)) {
+      return false;
+    }
+    (*count)++;
+    if (cfg_ends_block(op)) {
+      *end += 2;
+      return false;
+    }
+  }
+  return true;
+}
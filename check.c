@@ -0,0 +1,500 @@
+#define _POSIX_C_SOURCE 200809L // getopt, clock_gettime
+#define CHIP8_RAND chip8_rand
+#include "chip8.c"
+
+// the ROMs in tests/, compiled by chip8-aot with their name as prefix
+#include "tests/alu.aot.c"
+#include "tests/draw.aot.c"
+#include "tests/invalid.aot.c"
+#include "tests/keys.aot.c"
+#include "tests/selfmod.aot.c"
+#include "tests/timers.aot.c"
+#include "tests/vblank.aot.c"
+// and with the extra blocks in its block map
+#include "tests/selfmod_map.aot.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Runs every case in a golden file on every engine, compares the display and
+// registers at the end against the expected values, and measures instructions
+// per second. A case is one line:
+//
+//   rom mode frames input display pc i sp dt st v
+//
+// mode is fixed or accurate, input is - or a comma separated list of frame+key
+// and frame-key (key down and up at the start of that frame, key in hex),
+// display is the FNV-1a hash of the display and v is V0 to VF as hex bytes.
+
+#define CHECK_MAX_CASES 256
+#define CHECK_MAX_INPUT 64
+#define CHECK_LINE_LEN 512
+#define CHECK_PERF_RUNS 3
+#define CHECK_PERF_SECONDS 0.02
+#define CHECK_PERF_ATTEMPTS 5 // measurements for a baseline, and before a case counts as slower
+
+struct check_aot {
+  bool (*matches)(struct chip8 *chip8);
+  int (*run_frame)(struct chip8 *chip8, bool *redraw);
+} check_aots[] = {
+  {alu_matches, alu_run_frame},
+  {draw_matches, draw_run_frame},
+  {invalid_matches, invalid_run_frame},
+  {keys_matches, keys_run_frame},
+  {selfmod_matches, selfmod_run_frame},
+  {timers_matches, timers_run_frame},
+  {vblank_matches, vblank_run_frame},
+}, check_map_aots[] = {
+  {selfmod_map_matches, selfmod_map_run_frame},
+};
+
+enum check_engine {
+  ENGINE_CYCLE,
+  ENGINE_AOT,
+  ENGINE_AOT_MAP, // only for ROMs with a block map
+  ENGINES,
+};
+
+char *check_engine_names[ENGINES] = {"cycle", "aot", "map"};
+
+struct check_input {
+  uint32_t frame;
+  uint8_t key_code;
+  bool down;
+};
+
+struct check_result {
+  uint64_t display;
+  uint16_t pc;
+  uint16_t i;
+  uint8_t sp;
+  uint8_t dt;
+  uint8_t st;
+  uint8_t v[16];
+};
+
+struct check_case {
+  char rom[256];
+  char mode[16];
+  uint32_t frames;
+  char input_text[256];
+  struct check_input input[CHECK_MAX_INPUT];
+  size_t input_len;
+  struct check_result expected;
+
+  struct chip8_image image;
+  struct chip8 initial;
+  struct check_aot *aot;
+  struct check_aot *map_aot;
+};
+
+struct check_case cases[CHECK_MAX_CASES];
+volatile uint64_t check_sink; // keeps the calibration from being optimized out
+
+void die(char *s) {
+  perror(s);
+  exit(1);
+}
+
+size_t read_file(char *file, uint8_t *buffer, size_t buffer_len) {
+  FILE *f = fopen(file, "r");
+  if (f == NULL) {
+    die("fopen");
+  }
+  size_t bytes_read = fread(buffer, sizeof *buffer, buffer_len, f);
+  if (!feof(f)) {
+    die("fread");
+  }
+  if (fclose(f) != 0) {
+    die("fclose");
+  }
+  return bytes_read;
+}
+
+double seconds_since(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+uint64_t check_hash(uint8_t *data, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ data[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+bool check_parse_input(struct check_case *c) {
+  if (strcmp(c->input_text, "-") == 0) {
+    return true;
+  }
+  char *s = c->input_text;
+  for (;;) {
+    if (c->input_len == CHECK_MAX_INPUT) {
+      return false;
+    }
+    struct check_input *input = &c->input[c->input_len++];
+    char *end;
+    input->frame = strtoul(s, &end, 10);
+    if (end == s || (*end != '+' && *end != '-')) {
+      return false;
+    }
+    input->down = *end == '+';
+    s = end + 1;
+    input->key_code = strtoul(s, &end, 16);
+    if (end == s || input->key_code > 0xf) {
+      return false;
+    }
+    if (c->input_len > 1 && input->frame < c->input[c->input_len - 2].frame) {
+      return false;
+    }
+    if (*end == '\0') {
+      return true;
+    }
+    if (*end != ',') {
+      return false;
+    }
+    s = end + 1;
+  }
+}
+
+// Parses a case from line, returns false if it is not one.
+bool check_parse(char *line, struct check_case *c) {
+  char v[64];
+  unsigned long long display;
+  unsigned int pc, i, sp, dt, st;
+  int fields = sscanf(line, "%255s %15s %u %255s %llx %x %x %x %x %x %63s", c->rom, c->mode, &c->frames,
+      c->input_text, &display, &pc, &i, &sp, &dt, &st, v);
+  if (fields != 11 || strlen(v) != 2 * sizeof c->expected.v) {
+    return false;
+  }
+  if (strcmp(c->mode, "fixed") != 0 && strcmp(c->mode, "accurate") != 0) {
+    return false;
+  }
+  c->expected.display = display;
+  c->expected.pc = pc;
+  c->expected.i = i;
+  c->expected.sp = sp;
+  c->expected.dt = dt;
+  c->expected.st = st;
+  for (size_t r = 0; r < sizeof c->expected.v; r++) {
+    unsigned int value;
+    if (sscanf(&v[2 * r], "%2x", &value) != 1) {
+      return false;
+    }
+    c->expected.v[r] = value;
+  }
+  return check_parse_input(c);
+}
+
+void check_load(struct check_case *c) {
+  chip8_image_init(&c->image);
+  read_file(c->rom, &c->image.memory[PROGRAM_START_ADDRESS], (sizeof c->image.memory) - PROGRAM_START_ADDRESS);
+  chip8_init(&c->initial, &c->image);
+  c->initial.accurate_timing = strcmp(c->mode, "accurate") == 0;
+  c->aot = NULL;
+  for (size_t a = 0; a < ARRAY_LEN(check_aots); a++) {
+    if (check_aots[a].matches(&c->initial)) {
+      c->aot = &check_aots[a];
+    }
+  }
+  c->map_aot = NULL;
+  for (size_t a = 0; a < ARRAY_LEN(check_map_aots); a++) {
+    if (check_map_aots[a].matches(&c->initial)) {
+      c->map_aot = &check_map_aots[a];
+    }
+  }
+}
+
+// Runs the case on chip8 from the start, returns the instructions executed.
+uint64_t check_run(struct check_case *c, struct chip8 *chip8, enum check_engine engine) {
+  chip8_restore(chip8, &c->initial);
+
+  uint64_t executed = 0;
+  size_t next_input = 0;
+  bool redraw = false;
+  struct cycle_result res;
+  for (uint32_t frame = 0; frame < c->frames; frame++) {
+    for (; next_input < c->input_len && c->input[next_input].frame == frame; next_input++) {
+      if (c->input[next_input].down) {
+        chip8_key_code_down(chip8, c->input[next_input].key_code);
+      } else {
+        chip8_key_code_up(chip8, c->input[next_input].key_code);
+      }
+    }
+
+    chip8_60hz_timer(chip8);
+
+    if (engine == ENGINE_AOT) {
+      executed += c->aot->run_frame(chip8, &redraw);
+    } else if (engine == ENGINE_AOT_MAP) {
+      executed += c->map_aot->run_frame(chip8, &redraw);
+    } else {
+      uint64_t frame_end = chip8_frame_end(chip8);
+      int i = 0;
+      for (; !chip8_frame_done(chip8, frame_end, i); i++) {
+        cycle(chip8, &res);
+      }
+      executed += i;
+    }
+  }
+  return executed;
+}
+
+struct check_result check_result(struct chip8 *chip8) {
+  struct check_result result = {0};
+  result.display = check_hash(chip8->display, sizeof chip8->display);
+  result.pc = chip8->pc;
+  result.i = chip8->i;
+  result.sp = chip8->sp;
+  result.dt = chip8_dt(chip8);
+  result.st = chip8_st(chip8);
+  memcpy(result.v, chip8->v, sizeof result.v);
+  return result;
+}
+
+void check_print_result(FILE *f, struct check_result *result) {
+  fprintf(f, "%016llx %03x %03x %02x %02x %02x ", (unsigned long long)result->display, result->pc, result->i,
+      result->sp, result->dt, result->st);
+  for (size_t r = 0; r < sizeof result->v; r++) {
+    fprintf(f, "%02x", result->v[r]);
+  }
+}
+
+bool check_result_equals(struct check_result *a, struct check_result *b) {
+  return a->display == b->display && a->pc == b->pc && a->i == b->i && a->sp == b->sp && a->dt == b->dt &&
+    a->st == b->st && memcmp(a->v, b->v, sizeof a->v) == 0;
+}
+
+// How fast plain C code that does not depend on the emulator runs right now,
+// in bytes hashed per second. Rates are compared relative to it, as the speed
+// of the machine changes with whatever else it is doing.
+double check_calibration(void) {
+  static uint8_t data[1 << 12];
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t hashed = 0;
+  double seconds;
+  do {
+    check_sink = check_hash(data, sizeof data);
+    hashed += sizeof data;
+  } while ((seconds = seconds_since(&start)) < CHECK_PERF_SECONDS / 2);
+  return hashed / seconds;
+}
+
+// Best instructions per second of a few runs, each repeating the case for a
+// little while, and the best rate relative to the calibration of its run.
+double check_perf(struct check_case *c, struct chip8 *chip8, enum check_engine engine, double *relative) {
+  double best = 0;
+  *relative = 0;
+  for (int run = 0; run < CHECK_PERF_RUNS; run++) {
+    double calibration = check_calibration();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t executed = 0;
+    double seconds;
+    do {
+      executed += check_run(c, chip8, engine);
+    } while ((seconds = seconds_since(&start)) < CHECK_PERF_SECONDS);
+    if (executed / seconds > best) {
+      best = executed / seconds;
+    }
+    if (executed / seconds / calibration > *relative) {
+      *relative = executed / seconds / calibration;
+    }
+  }
+  return best;
+}
+
+int check_compare(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Identifies a measurement in the baseline file.
+void check_perf_key(char *key, size_t key_len, struct check_case *c, enum check_engine engine) {
+  snprintf(key, key_len, "%s %s %u %s %s", c->rom, c->mode, c->frames, c->input_text, check_engine_names[engine]);
+}
+
+// Looks up the relative rate for key in a baseline file, or returns 0.
+double check_baseline(FILE *f, char *key) {
+  char line[CHECK_LINE_LEN];
+  size_t key_len = strlen(key);
+  rewind(f);
+  while (fgets(line, sizeof line, f) != NULL) {
+    if (strncmp(line, key, key_len) == 0 && line[key_len] == ' ') {
+      return strtod(&line[key_len + 1], NULL);
+    }
+  }
+  return 0;
+}
+
+void usage(void) {
+  fprintf(stderr, "usage: chip8-check [-u] [-b baseline | -w baseline] [-t percent] golden\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  bool update = false;
+  char *baseline_file = NULL;
+  bool new_baseline = false;
+  double threshold = 25;
+  int opt;
+  while ((opt = getopt(argc, argv, "ub:w:t:")) != -1) {
+    switch (opt) {
+      case 'u':
+        update = true;
+        break;
+      case 'b':
+        baseline_file = optarg;
+        new_baseline = false;
+        break;
+      case 'w':
+        baseline_file = optarg;
+        new_baseline = true;
+        break;
+      case 't':
+        threshold = strtod(optarg, NULL);
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+  }
+  char *golden_file = argv[optind];
+
+  FILE *golden = fopen(golden_file, "r");
+  if (golden == NULL) {
+    die("fopen");
+  }
+
+  // a baseline is only written when asked for with -w, so that a slow run
+  // cannot quietly become the bar the next ones are held to
+  FILE *baseline = NULL;
+  if (baseline_file != NULL && !update) {
+    baseline = fopen(baseline_file, new_baseline ? "w" : "r");
+    if (baseline == NULL) {
+      die(baseline_file);
+    }
+  }
+
+  static struct chip8 chip8;
+  size_t num_cases = 0;
+  int failures = 0;
+  char line[CHECK_LINE_LEN];
+  for (int line_number = 1; fgets(line, sizeof line, golden) != NULL; line_number++) {
+    size_t start = strspn(line, " \t");
+    if (line[start] == '#' || line[start] == '\n' || line[start] == '\0') {
+      if (update) {
+        fputs(line, stdout);
+      }
+      continue;
+    }
+    if (num_cases == CHECK_MAX_CASES) {
+      fprintf(stderr, "%s:%d: too many cases\n", golden_file, line_number);
+      exit(1);
+    }
+    struct check_case *c = &cases[num_cases++];
+    if (!check_parse(line, c)) {
+      fprintf(stderr, "%s:%d: not a case\n", golden_file, line_number);
+      exit(1);
+    }
+    check_load(c);
+    chip8_free(&chip8);
+    chip8 = c->initial;
+
+    // the reference interpreter decides what the expected values are
+    if (update) {
+      check_run(c, &chip8, ENGINE_CYCLE);
+      struct check_result result = check_result(&chip8);
+      printf("%-20s %-8s %5u %-16s ", c->rom, c->mode, c->frames, c->input_text);
+      check_print_result(stdout, &result);
+      printf("\n");
+      continue;
+    }
+
+    double interpreter = 0; // the baseline of ENGINE_CYCLE on this case
+    for (enum check_engine engine = 0; engine < ENGINES; engine++) {
+      if (engine == ENGINE_AOT_MAP && c->map_aot == NULL) {
+        continue;
+      }
+      printf("%-20s %-8s %5u %-16s %-5s ", c->rom, c->mode, c->frames, c->input_text, check_engine_names[engine]);
+      if (engine == ENGINE_AOT && c->aot == NULL) {
+        printf("FAIL not compiled in\n");
+        failures++;
+        continue;
+      }
+
+      check_run(c, &chip8, engine);
+      struct check_result result = check_result(&chip8);
+      if (!check_result_equals(&result, &c->expected)) {
+        printf("FAIL\n  got      ");
+        check_print_result(stdout, &result);
+        printf("\n  expected ");
+        check_print_result(stdout, &c->expected);
+        printf("\n");
+        failures++;
+        continue;
+      }
+
+      char key[CHECK_LINE_LEN];
+      check_perf_key(key, sizeof key, c, engine);
+      double expected = baseline != NULL && !new_baseline ? check_baseline(baseline, key) : 0;
+      if (engine == ENGINE_CYCLE) {
+        interpreter = expected;
+      }
+      double relative[CHECK_PERF_ATTEMPTS];
+      double rate = check_perf(c, &chip8, engine, &relative[0]);
+      if (new_baseline) {
+        // the median, so that one lucky measurement does not set the bar
+        for (int attempt = 1; attempt < CHECK_PERF_ATTEMPTS; attempt++) {
+          check_perf(c, &chip8, engine, &relative[attempt]);
+        }
+        qsort(relative, CHECK_PERF_ATTEMPTS, sizeof *relative, check_compare);
+        fprintf(baseline, "%s %.6g\n", key, relative[CHECK_PERF_ATTEMPTS / 2]);
+        printf("ok %7.2fM instructions/s", rate / 1e6);
+      } else {
+        // compiling with a block map is only worth it if it beats the interpreter
+        double bar = expected * (1 - threshold / 100);
+        if (engine == ENGINE_AOT_MAP && interpreter > bar) {
+          bar = interpreter;
+        }
+        // a single measurement can be unlucky, a regression is slow every time
+        for (int attempt = 1; attempt < CHECK_PERF_ATTEMPTS && relative[0] < bar; attempt++) {
+          double retry = check_perf(c, &chip8, engine, &relative[1]);
+          rate = retry > rate ? retry : rate;
+          relative[0] = relative[1] > relative[0] ? relative[1] : relative[0];
+        }
+        printf("ok %7.2fM instructions/s", rate / 1e6);
+        if (baseline != NULL && expected == 0) {
+          printf(" FAIL not in the baseline");
+          failures++;
+        } else if (relative[0] < expected * (1 - threshold / 100)) {
+          printf(" FAIL %.0f%% slower than the baseline", 100 * (1 - relative[0] / expected));
+          failures++;
+        } else if (engine == ENGINE_AOT_MAP && relative[0] < interpreter) {
+          printf(" FAIL %.0f%% slower than the interpreter", 100 * (1 - relative[0] / interpreter));
+          failures++;
+        }
+      }
+      printf("\n");
+    }
+  }
+  fclose(golden);
+  if (baseline != NULL && fclose(baseline) != 0) {
+    die("fclose");
+  }
+  chip8_free(&chip8);
+
+  if (failures > 0) {
+    fprintf(stderr, "%d failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -1,19 +1,42 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
 #define PROGRAM_START_ADDRESS 0x200
 
+// Memory is split in pages that instances share until they write to them.
+// Addresses wrap around at the end of memory.
+#define CHIP8_MEMORY_SIZE 4096
+#define CHIP8_PAGE_SHIFT 8
+#define CHIP8_PAGE_SIZE (1 << CHIP8_PAGE_SHIFT)
+#define CHIP8_PAGES (CHIP8_MEMORY_SIZE / CHIP8_PAGE_SIZE)
+
 #define DISPLAY_COLS 64
 #define DISPLAY_ROWS 32
 #define DISPLAY_BYTES ((DISPLAY_COLS * DISPLAY_ROWS) / 8)
 
-#ifndef CHIP8_RAND
-#define CHIP8_RAND() (0)
+// xorshift seed, see chip8_rand()
+#define CHIP8_RAND_SEED 0x2545f491
+
+// called with the old and new pc after every instruction, e.g. for coverage
+#ifndef CHIP8_TRACE_BRANCH
+#define CHIP8_TRACE_BRANCH(from, to)
 #endif
 
+// fixed timing: instructions run between two 60hz timer ticks
+#define CHIP8_INSTRUCTIONS_PER_FRAME 30
+
+// accurate timing: the COSMAC VIP runs at 1.76 MHz with 8 clocks per machine
+// cycle, which gives 3668 machine cycles per 60hz frame
+#define CHIP8_CYCLES_PER_FRAME 3668
+
+#define CHIP8_DIRTY_CHUNK_SHIFT 6 // 64 byte chunks, one bit each in dirty_chunks
+
 #define CHIP8_KEY_CODE_NO_KEY 0x1F
 #define CHIP8_KEY_CODE_EVENT_WANTED 0x2F
 
@@ -36,8 +59,17 @@ uint8_t font[] = {
   0xF0, 0x80, 0xF0, 0x80, 0x80,
 };
 
+// The font and program, read-only once instances are created from it.
+struct chip8_image {
+  uint8_t memory[CHIP8_MEMORY_SIZE];
+};
+
 struct chip8 {
-  uint8_t memory[4096];
+  // pages of memory, pointing into the image until copied on first write
+  uint8_t *pages[CHIP8_PAGES];
+  // bits for pages this instance copied and has to free
+  uint16_t private_pages;
+
   uint8_t display[DISPLAY_BYTES];
   uint16_t stack[16];
   uint8_t v[16];
@@ -53,8 +85,41 @@ struct chip8 {
 
   // the last key that was released, or CHIP8_KEY_CODE_NO_KEY
   uint8_t last_key_released_event;
+
+  // bits for 64 byte chunks of memory written since the last snapshot
+  uint64_t dirty_chunks;
+  // the same since chip8_init(), not cleared by snapshots, for compiled code to
+  // find blocks that were overwritten
+  uint64_t written_chunks;
+
+  // machine cycles spent so far
+  uint64_t cycles;
+
+  // xorshift state of chip8_rand(), never 0
+  uint32_t rand_state;
+
+  // charge instructions by their cost instead of running a fixed number per
+  // frame, and derive dt and st from cycles rather than chip8_60hz_timer()
+  bool accurate_timing;
+
+  // cycles when dt and st were set, dt and st hold the values set then
+  uint64_t dt_set_at;
+  uint64_t st_set_at;
 };
 
+// xorshift on the instance, for frontends that want to reproduce or save the
+// random numbers CXNN sees: #define CHIP8_RAND chip8_rand
+uint8_t chip8_rand(struct chip8 *chip8) {
+  chip8->rand_state ^= chip8->rand_state << 13;
+  chip8->rand_state ^= chip8->rand_state >> 17;
+  chip8->rand_state ^= chip8->rand_state << 5;
+  return chip8->rand_state;
+}
+
+#ifndef CHIP8_RAND
+#define CHIP8_RAND(chip8) (0)
+#endif
+
 // Every key can have two events max, press - depress. Repetition overwrites.
 // Goes from depress -> press -> depress -> press
 // However we want to know if if a depress happened
@@ -100,6 +165,47 @@ enum opcode {
   OP_FX65,
 };
 
+// Approximate machine cycles per instruction on the COSMAC VIP interpreter,
+// including fetch and decode. DXYN is charged separately, as its cost depends
+// on the sprite.
+uint16_t chip8_cycle_costs[] = {
+  [OP_00E0] = 24,
+  [OP_00EE] = 23,
+  [OP_0NNN] = 23,
+  [OP_1NNN] = 23,
+  [OP_2NNN] = 23,
+  [OP_3XNN] = 12,
+  [OP_4XNN] = 12,
+  [OP_5XY0] = 14,
+  [OP_6XNN] = 6,
+  [OP_7XNN] = 10,
+  [OP_8XY0] = 44,
+  [OP_8XY1] = 44,
+  [OP_8XY2] = 44,
+  [OP_8XY3] = 44,
+  [OP_8XY4] = 44,
+  [OP_8XY5] = 44,
+  [OP_8XY6] = 44,
+  [OP_8XY7] = 44,
+  [OP_8XYE] = 44,
+  [OP_9XY0] = 14,
+  [OP_ANNN] = 12,
+  [OP_BNNN] = 23,
+  [OP_CXNN] = 36,
+  [OP_DXYN] = 0,
+  [OP_EX9E] = 16,
+  [OP_EXA1] = 16,
+  [OP_FX07] = 10,
+  [OP_FX0A] = 10,
+  [OP_FX15] = 10,
+  [OP_FX18] = 10,
+  [OP_FX1E] = 19,
+  [OP_FX29] = 20,
+  [OP_FX33] = 204,
+  [OP_FX55] = 133,
+  [OP_FX65] = 133,
+};
+
 struct instruction {
   uint8_t value[2];
   enum opcode operation;
@@ -125,7 +231,65 @@ bool chip8_is_key_code_pressed(struct chip8 *chip8, uint8_t key_code) {
   return (chip8->keys_currently_pressed & (1 << key_code)) != 0;
 }
 
+// The first cycle of the next frame.
+uint64_t chip8_frame_end(struct chip8 *chip8) {
+  return (chip8->cycles / CHIP8_CYCLES_PER_FRAME + 1) * CHIP8_CYCLES_PER_FRAME;
+}
+
+// With accurate timing, waits for the vertical blank like the VIP interpreter
+// does before drawing a sprite, unless a frame is just starting.
+void chip8_wait_vblank(struct chip8 *chip8) {
+  if (chip8->accurate_timing && chip8->cycles % CHIP8_CYCLES_PER_FRAME != 0) {
+    chip8->cycles = chip8_frame_end(chip8);
+  }
+}
+
+// Whether the current frame is over, after executed instructions in it.
+bool chip8_frame_done(struct chip8 *chip8, uint64_t frame_end, int executed) {
+  if (chip8->accurate_timing) {
+    return chip8->cycles >= frame_end;
+  }
+  return executed >= CHIP8_INSTRUCTIONS_PER_FRAME;
+}
+
+// A timer set at set_at, counted down by the 60hz ticks since then.
+uint8_t chip8_timer(struct chip8 *chip8, uint8_t value, uint64_t set_at) {
+  uint64_t ticks = chip8->cycles / CHIP8_CYCLES_PER_FRAME - set_at / CHIP8_CYCLES_PER_FRAME;
+  if (ticks >= value) {
+    return 0;
+  }
+  return value - ticks;
+}
+
+uint8_t chip8_dt(struct chip8 *chip8) {
+  if (chip8->accurate_timing) {
+    return chip8_timer(chip8, chip8->dt, chip8->dt_set_at);
+  }
+  return chip8->dt;
+}
+
+uint8_t chip8_st(struct chip8 *chip8) {
+  if (chip8->accurate_timing) {
+    return chip8_timer(chip8, chip8->st, chip8->st_set_at);
+  }
+  return chip8->st;
+}
+
+void chip8_set_dt(struct chip8 *chip8, uint8_t value) {
+  chip8->dt = value;
+  chip8->dt_set_at = chip8->cycles;
+}
+
+void chip8_set_st(struct chip8 *chip8, uint8_t value) {
+  chip8->st = value;
+  chip8->st_set_at = chip8->cycles;
+}
+
+// With accurate_timing the timers follow the cycle count and this does nothing.
 void chip8_60hz_timer(struct chip8 *chip8) {
+  if (chip8->accurate_timing) {
+    return;
+  }
   if (chip8->dt > 0) {
     chip8->dt--;
   }
@@ -134,11 +298,120 @@ void chip8_60hz_timer(struct chip8 *chip8) {
   }
 }
 
-void chip8_init(struct chip8 *chip8) {
-  memcpy(chip8->memory, font, sizeof(font));
+void chip8_image_init(struct chip8_image *image) {
+  memcpy(image->memory, font, sizeof(font));
+}
+
+void chip8_init(struct chip8 *chip8, struct chip8_image *image) {
+  for (size_t page = 0; page < CHIP8_PAGES; page++) {
+    chip8->pages[page] = &image->memory[page * CHIP8_PAGE_SIZE];
+  }
   chip8->pc = PROGRAM_START_ADDRESS;
   chip8->sp = ARRAY_LEN(chip8->stack);
   chip8->last_key_released_event = CHIP8_KEY_CODE_NO_KEY;
+  chip8->rand_state = CHIP8_RAND_SEED;
+}
+
+// Frees the pages the instance copied.
+void chip8_free(struct chip8 *chip8) {
+  for (size_t page = 0; page < CHIP8_PAGES; page++) {
+    if (chip8->private_pages & (1 << page)) {
+      free(chip8->pages[page]);
+    }
+  }
+  chip8->private_pages = 0;
+}
+
+uint8_t chip8_read(struct chip8 *chip8, uint16_t address) {
+  address &= CHIP8_MEMORY_SIZE - 1;
+  return chip8->pages[address >> CHIP8_PAGE_SHIFT][address & (CHIP8_PAGE_SIZE - 1)];
+}
+
+void chip8_read_block(struct chip8 *chip8, uint16_t address, uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    data[i] = chip8_read(chip8, address + i);
+  }
+}
+
+bool chip8_memory_equals(struct chip8 *chip8, uint16_t address, const uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (chip8_read(chip8, address + i) != data[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void chip8_mark_dirty(struct chip8 *chip8, uint16_t address) {
+  uint64_t chunk = (uint64_t)1 << ((address & (CHIP8_MEMORY_SIZE - 1)) >> CHIP8_DIRTY_CHUNK_SHIFT);
+  chip8->dirty_chunks |= chunk;
+  chip8->written_chunks |= chunk;
+}
+
+// The page holding address, copied first if it is still shared.
+uint8_t *chip8_private_page(struct chip8 *chip8, uint16_t address) {
+  size_t page = (address & (CHIP8_MEMORY_SIZE - 1)) >> CHIP8_PAGE_SHIFT;
+  if (!(chip8->private_pages & (1 << page))) {
+    uint8_t *copy = malloc(CHIP8_PAGE_SIZE);
+    if (copy == NULL) {
+      abort();
+    }
+    memcpy(copy, chip8->pages[page], CHIP8_PAGE_SIZE);
+    chip8->pages[page] = copy;
+    chip8->private_pages |= 1 << page;
+  }
+  return chip8->pages[page];
+}
+
+void chip8_write(struct chip8 *chip8, uint16_t address, uint8_t value) {
+  chip8_private_page(chip8, address)[address & (CHIP8_PAGE_SIZE - 1)] = value;
+  chip8_mark_dirty(chip8, address);
+}
+
+void chip8_write_block(struct chip8 *chip8, uint16_t address, const uint8_t *data, size_t len) {
+  while (len > 0) {
+    address &= CHIP8_MEMORY_SIZE - 1;
+    size_t offset = address & (CHIP8_PAGE_SIZE - 1);
+    size_t n = CHIP8_PAGE_SIZE - offset < len ? CHIP8_PAGE_SIZE - offset : len;
+    memcpy(chip8_private_page(chip8, address) + offset, data, n);
+    for (size_t chunk = address >> CHIP8_DIRTY_CHUNK_SHIFT; chunk <= (address + n - 1) >> CHIP8_DIRTY_CHUNK_SHIFT; chunk++) {
+      chip8_mark_dirty(chip8, chunk << CHIP8_DIRTY_CHUNK_SHIFT);
+    }
+    address += n;
+    data += n;
+    len -= n;
+  }
+}
+
+// Remember the current state so chip8_restore() can return to it. The snapshot
+// gets its own copy of the pages the instance wrote; chip8_free() it when done.
+void chip8_snapshot(struct chip8 *chip8, struct chip8 *snapshot) {
+  chip8->dirty_chunks = 0;
+  *snapshot = *chip8;
+  snapshot->private_pages = 0;
+  for (size_t page = 0; page < CHIP8_PAGES; page++) {
+    if (chip8->private_pages & (1 << page)) {
+      chip8_private_page(snapshot, page << CHIP8_PAGE_SHIFT);
+    }
+  }
+}
+
+// Return to a snapshot, copying only the memory chunks written since it was
+// taken. The instance keeps the pages it owns.
+void chip8_restore(struct chip8 *chip8, const struct chip8 *snapshot) {
+  size_t chunk_size = 1 << CHIP8_DIRTY_CHUNK_SHIFT;
+  uint64_t dirty = chip8->dirty_chunks;
+  for (size_t chunk = 0; dirty != 0; chunk++, dirty >>= 1) {
+    if (dirty & 1) {
+      // written, so the page is already private
+      size_t address = chunk * chunk_size;
+      size_t page = address >> CHIP8_PAGE_SHIFT;
+      size_t offset = address & (CHIP8_PAGE_SIZE - 1);
+      memcpy(&chip8->pages[page][offset], &snapshot->pages[page][offset], chunk_size);
+    }
+  }
+  size_t rest = offsetof(struct chip8, display);
+  memcpy((uint8_t *)chip8 + rest, (const uint8_t *)snapshot + rest, sizeof *chip8 - rest);
 }
 
 size_t min(size_t a, size_t b) {
@@ -148,9 +421,53 @@ size_t min(size_t a, size_t b) {
   return b;
 }
 
+// Draw a sprite at position VX, VY with N bytes of sprite data starting at the address stored in I
+// Set VF to 01 if any set pixels are changed to unset, and 00 otherwise
+void chip8_draw_sprite(struct chip8 *chip8, uint8_t x, uint8_t y, uint8_t n) {
+  uint8_t col = chip8->v[x] & (DISPLAY_COLS - 1);
+  uint8_t row = chip8->v[y] & (DISPLAY_ROWS - 1);
+  uint16_t address = chip8->i;
+  chip8->v[0xf] = 0;
+  for (size_t i = 0; i < n && row < DISPLAY_ROWS; i++) {
+    uint8_t sprite_data = chip8_read(chip8, address);
+
+    for (size_t bit = 0, end = min(DISPLAY_COLS - col, 8); bit < end; bit++) {
+      size_t display_pos = (row * DISPLAY_COLS) + col + bit;
+      uint8_t prev_byte = chip8->display[display_pos / 8];
+      uint8_t prev_bit = prev_byte >> (7 - (display_pos % 8)) & 1;
+      uint8_t sprite_bit = (sprite_data >> (7 - bit)) & 1;
+      uint8_t new_bit = prev_bit ^ sprite_bit;
+      uint8_t prev_byte_cleared_bit = prev_byte & ~(1 << (7 - (display_pos % 8)));
+      uint8_t new_byte = prev_byte_cleared_bit | (new_bit << (7 - (display_pos % 8)));
+      chip8->display[display_pos / 8] = new_byte;
+      if (prev_bit == 1 && new_bit == 0) {
+        chip8->v[0xf] = 1;
+      }
+    }
+    address++;
+    row++;
+  }
+}
+
+void chip8_store_bcd(struct chip8 *chip8, uint8_t x) {
+  chip8_write(chip8, chip8->i, chip8->v[x] / 100);
+  chip8_write(chip8, chip8->i + 1, (chip8->v[x] / 10) % 10);
+  chip8_write(chip8, chip8->i + 2, chip8->v[x] % 10);
+}
+
+void chip8_store_registers(struct chip8 *chip8, uint8_t x) {
+  chip8_write_block(chip8, chip8->i, chip8->v, x + 1);
+  chip8->i = chip8->i + x + 1;
+}
+
+void chip8_load_registers(struct chip8 *chip8, uint8_t x) {
+  chip8_read_block(chip8, chip8->i, chip8->v, x + 1);
+  chip8->i = chip8->i + x + 1;
+}
+
 void cycle(struct chip8 *chip8, struct cycle_result *res) {
-  uint8_t b1 = chip8->memory[chip8->pc];
-  uint8_t b2 = chip8->memory[chip8->pc + 1];
+  uint8_t b1 = chip8_read(chip8, chip8->pc);
+  uint8_t b2 = chip8_read(chip8, chip8->pc + 1);
   uint16_t new_pc = chip8->pc + 2;
 
   uint8_t b1lo = b1 & 0xf;
@@ -313,38 +630,16 @@ void cycle(struct chip8 *chip8, struct cycle_result *res) {
       break;
     case 0xc:
       res->instr.operation = OP_CXNN;
-      chip8->v[b1lo] = CHIP8_RAND() & b2;
+      chip8->v[b1lo] = CHIP8_RAND(chip8) & b2;
       break;
-    case 0xd: {
+    case 0xd:
       res->instr.operation = OP_DXYN;
-      // Draw a sprite at position VX, VY with N bytes of sprite data starting at the address stored in I
-      // Set VF to 01 if any set pixels are changed to unset, and 00 otherwise
       res->redraw_needed = true;
-      uint8_t col = chip8->v[b1lo] & (DISPLAY_COLS - 1);
-      uint8_t row = chip8->v[b2hi] & (DISPLAY_ROWS - 1);
-      uint16_t address = chip8->i;
-      chip8->v[0xf] = 0;
-      for (size_t i = 0; i < b2lo && row < DISPLAY_ROWS; i++) {
-        uint8_t sprite_data = chip8->memory[address];
-
-        for (size_t bit = 0, end = min(DISPLAY_COLS - col, 8); bit < end; bit++) {
-          size_t display_pos = (row * DISPLAY_COLS) + col + bit;
-          uint8_t prev_byte = chip8->display[display_pos / 8];
-          uint8_t prev_bit = prev_byte >> (7 - (display_pos % 8)) & 1;
-          uint8_t sprite_bit = (sprite_data >> (7 - bit)) & 1;
-          uint8_t new_bit = prev_bit ^ sprite_bit;
-          uint8_t prev_byte_cleared_bit = prev_byte & ~(1 << (7 - (display_pos % 8)));
-          uint8_t new_byte = prev_byte_cleared_bit | (new_bit << (7 - (display_pos % 8)));
-          chip8->display[display_pos / 8] = new_byte;
-          if (prev_bit == 1 && new_bit == 0) {
-            chip8->v[0xf] = 1;
-          }
-        }
-        address++;
-        row++;
-      }
+      chip8_wait_vblank(chip8);
+      // rows that straddle two display bytes take longer
+      chip8->cycles += 26 + b2lo * ((chip8->v[b1lo] & 7) ? 26 : 17);
+      chip8_draw_sprite(chip8, b1lo, b2hi, b2lo);
       break;
-    }
     case 0xe:
       switch (b2) {
         case 0x9e:
@@ -370,7 +665,7 @@ void cycle(struct chip8 *chip8, struct cycle_result *res) {
         case 0x07:
           res->instr.operation = OP_FX07;
           // Store the current value of the delay timer in register VX
-          chip8->v[b1lo] = chip8->dt;
+          chip8->v[b1lo] = chip8_dt(chip8);
           break;
         case 0x0a:
           res->instr.operation = OP_FX0A;
@@ -386,12 +681,12 @@ void cycle(struct chip8 *chip8, struct cycle_result *res) {
         case 0x15:
           res->instr.operation = OP_FX15;
           // Set the delay timer to the value of register VX
-          chip8->dt = chip8->v[b1lo];
+          chip8_set_dt(chip8, chip8->v[b1lo]);
           break;
         case 0x18:
           res->instr.operation = OP_FX18;
           // Set the sound timer to the value of register VX
-          chip8->st = chip8->v[b1lo];
+          chip8_set_st(chip8, chip8->v[b1lo]);
           break;
         case 0x1e:
           res->instr.operation = OP_FX1E;
@@ -406,23 +701,19 @@ void cycle(struct chip8 *chip8, struct cycle_result *res) {
         case 0x33:
           res->instr.operation = OP_FX33;
           // Store the binary-coded decimal equivalent of the value stored in register VX at addresses I, I + 1, and I + 2
-          chip8->memory[chip8->i] = chip8->v[b1lo] / 100;
-          chip8->memory[chip8->i + 1] = (chip8->v[b1lo] / 10) % 10;
-          chip8->memory[chip8->i + 2] = chip8->v[b1lo] % 10;
+          chip8_store_bcd(chip8, b1lo);
           break;
         case 0x55:
           res->instr.operation = OP_FX55;
           // Store the values of registers V0 to VX inclusive in memory starting at address I
           // I is set to I + X + 1 after operation
-          memcpy(&chip8->memory[chip8->i], chip8->v, b1lo + 1);
-          chip8->i = chip8->i + b1lo + 1;
+          chip8_store_registers(chip8, b1lo);
           break;
         case 0x65:
           res->instr.operation = OP_FX65;
           // Fill registers V0 to VX inclusive with the values stored in memory starting at address I
           // I is set to I + X + 1 after operation
-          memcpy(chip8->v, &chip8->memory[chip8->i], b1lo + 1);
-          chip8->i = chip8->i + b1lo + 1;
+          chip8_load_registers(chip8, b1lo);
           break;
         default:
           assert(0);
@@ -431,9 +722,135 @@ void cycle(struct chip8 *chip8, struct cycle_result *res) {
     default:
       assert(0);
   }
+  chip8->cycles += chip8_cycle_costs[res->instr.operation];
+  CHIP8_TRACE_BRANCH(chip8->pc, new_pc);
   chip8->pc = new_pc;
 }
 
+// Writes instr in assembly to buffer.
+void chip8_disassemble(struct instruction *instr, char *buffer, size_t buffer_len) {
+  // last 12 bit
+  uint16_t nnn = ((instr->value[0] & 0xf) << 8) | instr->value[1];
+
+  // last byte
+  uint8_t nn = instr->value[1];
+
+  // 4 bit nibbles, excluding the first nibble because it never contains operands
+  uint8_t x = instr->value[0] & 0xf;
+  uint8_t y = instr->value[1] >> 4 & 0xf;
+  uint8_t n = instr->value[1] & 0xf;
+
+  switch (instr->operation) {
+    case OP_00E0:
+      snprintf(buffer, buffer_len, "CLS");
+      break;
+    case OP_00EE:
+      snprintf(buffer, buffer_len, "RET");
+      break;
+    case OP_0NNN:
+      snprintf(buffer, buffer_len, "SYS");
+      break;
+    case OP_1NNN:
+      snprintf(buffer, buffer_len, "JP %03x", nnn); // jump to address
+      break;
+    case OP_2NNN:
+      snprintf(buffer, buffer_len, "CALL %03x", nnn); // execute subroutine
+      break;
+    case OP_3XNN:
+      snprintf(buffer, buffer_len, "SEV V%01x %02x", x, nn); // skip if equal
+      break;
+    case OP_4XNN:
+      snprintf(buffer, buffer_len, "SNE V%01x %02x", x, nn); // skip if not equal
+      break;
+    case OP_5XY0:
+      snprintf(buffer, buffer_len, "SE V%01x V%01x", x, y); // skip if equal
+      break;
+    case OP_6XNN:
+      snprintf(buffer, buffer_len, "LD V%01x %02x", x, nn); // load in register
+      break;
+    case OP_7XNN:
+      snprintf(buffer, buffer_len, "ADD V%01x %02x", x, nn); // add constant
+      break;
+    case OP_8XY0:
+      snprintf(buffer, buffer_len, "LD V%01x V%01x", x, y);
+      break;
+    case OP_8XY1:
+      snprintf(buffer, buffer_len, "OR V%01x V%01x", x, y);
+      break;
+    case OP_8XY2:
+      snprintf(buffer, buffer_len, "AND V%01x V%01x", x, y);
+      break;
+    case OP_8XY3:
+      snprintf(buffer, buffer_len, "XOR V%01x V%01x", x, y);
+      break;
+    case OP_8XY4:
+      snprintf(buffer, buffer_len, "ADD V%01x V%01x", x, y);
+      break;
+    case OP_8XY5:
+      snprintf(buffer, buffer_len, "SUB V%01x V%01x", x, y);
+      break;
+    case OP_8XY6:
+      snprintf(buffer, buffer_len, "SHR V%01x V%01x", x, y);
+      break;
+    case OP_8XY7:
+      snprintf(buffer, buffer_len, "SUBN V%01x V%01x", x, y);
+      break;
+    case OP_8XYE:
+      snprintf(buffer, buffer_len, "SHL V%01x V%01x", x, y);
+      break;
+    case OP_9XY0:
+      snprintf(buffer, buffer_len, "SNE V%01x V%01x", x, y);
+      break;
+    case OP_ANNN:
+      snprintf(buffer, buffer_len, "LD I, %03x", nnn); // load NNN in register I
+      break;
+    case OP_BNNN:
+      snprintf(buffer, buffer_len, "JP V0, %03x", nnn); // jump to V0 + NNN
+      break;
+    case OP_CXNN:
+      snprintf(buffer, buffer_len, "RND V%01x, %02x", x, nn); // Set VX to a random number with a mask of NN
+      break;
+    case OP_DXYN:
+      snprintf(buffer, buffer_len, "DRW V%01x V%01x %01x", x, y, n);
+      break;
+    case OP_EX9E:
+      snprintf(buffer, buffer_len, "SKP V%01x", x);
+      break;
+    case OP_EXA1:
+      snprintf(buffer, buffer_len, "SKNP V%01x", x);
+      break;
+    case OP_FX07:
+      snprintf(buffer, buffer_len, "LD V%01x, DT", x);
+      break;
+    case OP_FX0A:
+      snprintf(buffer, buffer_len, "LD V%01x, K", x);
+      break;
+    case OP_FX15:
+      snprintf(buffer, buffer_len, "LD DT, V%01x", x);
+      break;
+    case OP_FX18:
+      snprintf(buffer, buffer_len, "LD ST, V%01x", x);
+      break;
+    case OP_FX1E:
+      snprintf(buffer, buffer_len, "ADD I, V%01x", x);
+      break;
+    case OP_FX29:
+      snprintf(buffer, buffer_len, "LD F, V%01x", x);
+      break;
+    case OP_FX33:
+      snprintf(buffer, buffer_len, "LD B, V%01x", x);
+      break;
+    case OP_FX55:
+      snprintf(buffer, buffer_len, "LD [I], V%01x", x);
+      break;
+    case OP_FX65:
+      snprintf(buffer, buffer_len, "LD V%01x, [I]", x);
+      break;
+    default:
+      snprintf(buffer, buffer_len, "UNKNOWN %02x%02x", instr->value[0], instr->value[1]);
+  }
+}
+
 uint8_t chip8_key_to_key_code(char key) {
   switch (key) {
     case '1': return 0x1;
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE // clock_gettime
+
+#include <stdint.h>
+
+// Edges between guest instructions, exposed to libFuzzer as extra coverage and
+// added to AFL's map by main() below.
+#define FUZZ_EDGES (1 << 16)
+#if defined(__linux__) && !defined(FUZZ_MAIN)
+__attribute__((section("__libfuzzer_extra_counters")))
+#endif
+uint8_t fuzz_edges[FUZZ_EDGES];
+#define CHIP8_TRACE_BRANCH(from, to) (fuzz_edges[(((from) << 4) ^ (to)) & (FUZZ_EDGES - 1)]++)
+
+#define CHIP8_RAND chip8_rand
+#include "chip8.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Input layout:
+//   2 bytes big endian ROM length, ROM bytes, then one byte per frame with the
+//   key code in the low nibble and bit 4 set while the key is held.
+#define FUZZ_MAX_FRAMES 256
+#define FUZZ_CYCLES_PER_FRAME 30
+
+struct chip8_image fuzz_image;
+struct chip8 fuzz_chip8;
+struct chip8 fuzz_snapshot;
+bool fuzz_initialized = false;
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (!fuzz_initialized) {
+    chip8_image_init(&fuzz_image);
+    chip8_init(&fuzz_chip8, &fuzz_image);
+    chip8_snapshot(&fuzz_chip8, &fuzz_snapshot);
+    fuzz_initialized = true;
+  }
+  if (size < 2) {
+    return 0;
+  }
+  size_t rom_len = min((data[0] << 8) | data[1], size - 2);
+  rom_len = min(rom_len, CHIP8_MEMORY_SIZE - PROGRAM_START_ADDRESS);
+  if (rom_len == 0) {
+    return 0;
+  }
+
+  chip8_restore(&fuzz_chip8, &fuzz_snapshot);
+  chip8_write_block(&fuzz_chip8, PROGRAM_START_ADDRESS, data + 2, rom_len);
+
+  const uint8_t *frames = data + 2 + rom_len;
+  size_t frames_len = min(size - 2 - rom_len, FUZZ_MAX_FRAMES);
+  struct cycle_result res = {0};
+  // run at least one frame so ROM-only inputs do something
+  for (size_t f = 0; f < frames_len || f == 0; f++) {
+    if (f < frames_len) {
+      uint8_t key_code = frames[f] & 0xf;
+      if (frames[f] & 0x10) {
+        chip8_key_code_down(&fuzz_chip8, key_code);
+      } else if (chip8_is_key_code_pressed(&fuzz_chip8, key_code)) {
+        chip8_key_code_up(&fuzz_chip8, key_code);
+      }
+    }
+    chip8_60hz_timer(&fuzz_chip8);
+    for (int i = 0; i < FUZZ_CYCLES_PER_FRAME; i++) {
+      cycle(&fuzz_chip8, &res);
+    }
+  }
+  return 0;
+}
+
+#ifdef FUZZ_MAIN
+#include <time.h>
+
+// Without libFuzzer: replay the given inputs, or with -b time resets of an
+// empty ROM. Under afl-clang-fast stdin is fuzzed in persistent mode.
+size_t fuzz_read(FILE *f, uint8_t *buffer, size_t buffer_len) {
+  size_t bytes_read = fread(buffer, sizeof *buffer, buffer_len, f);
+  if (ferror(f)) {
+    perror("fread");
+    exit(1);
+  }
+  return bytes_read;
+}
+
+#ifdef __AFL_HAVE_MANUAL_CONTROL
+// AFL's map, which the compiler fills with edges of the host code only. It is
+// MAP_SIZE (64 KB) bytes, as large as fuzz_edges.
+extern uint8_t *__afl_area_ptr;
+
+void fuzz_afl_edges(void) {
+  for (size_t e = 0; e < FUZZ_EDGES; e++) {
+    __afl_area_ptr[e] += fuzz_edges[e];
+  }
+}
+#endif
+
+int main(int argc, char **argv) {
+  static uint8_t buffer[2 + 4096 + FUZZ_MAX_FRAMES];
+
+  if (argc == 2 && strcmp(argv[1], "-b") == 0) {
+    // 00E0 (CLS) then 1200 (JP 200): one frame of 30 instructions per reset
+    uint8_t input[] = {0x00, 0x04, 0x00, 0xe0, 0x12, 0x00};
+    long iterations = 1000000;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long n = 0; n < iterations; n++) {
+      LLVMFuzzerTestOneInput(input, sizeof input);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%.0f resets/sec\n", iterations / seconds);
+    return 0;
+  }
+
+#ifdef __AFL_HAVE_MANUAL_CONTROL
+  while (__AFL_LOOP(100000)) {
+    memset(fuzz_edges, 0, sizeof fuzz_edges);
+    LLVMFuzzerTestOneInput(buffer, fuzz_read(stdin, buffer, sizeof buffer));
+    fuzz_afl_edges();
+  }
+#else
+  for (int a = 1; a < argc; a++) {
+    FILE *f = fopen(argv[a], "r");
+    if (f == NULL) {
+      perror("fopen");
+      exit(1);
+    }
+    LLVMFuzzerTestOneInput(buffer, fuzz_read(f, buffer, sizeof buffer));
+    fclose(f);
+  }
+#endif
+  return 0;
+}
+#endif
@@ -0,0 +1,226 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A save state is the fixed part of struct savestate, up to memory, followed by
+// the 64 byte chunks of memory in written_chunks, in address order. Memory that
+// was never written comes from the program. Fields have fixed widths and are
+// ordered so that there is no padding; integers are in host byte order, which
+// is little-endian on everything this builds for. Bump SAVESTATE_VERSION
+// whenever the layout changes.
+#define SAVESTATE_MAGIC "CHIP8SAV"
+#define SAVESTATE_VERSION 5
+
+struct savestate {
+  char magic[8];
+  uint32_t version;
+  uint32_t size; // SAVESTATE_HEADER_SIZE
+
+  // the program the state was saved from, its FNV-1a hash and length
+  uint64_t program_hash;
+  uint32_t program_len;
+
+  // struct chip8
+  uint32_t rand_state;
+  uint64_t cycles;
+  uint64_t dt_set_at;
+  uint64_t st_set_at;
+  uint64_t written_chunks; // chunks of memory that follow on disk
+  uint16_t stack[16];
+  uint16_t pc;
+  uint16_t i;
+  uint16_t keys_currently_pressed;
+  uint8_t v[16];
+  uint8_t sp;
+  uint8_t dt;
+  uint8_t st;
+  uint8_t last_key_released_event;
+  uint8_t accurate_timing;
+
+  // frontend state
+  uint8_t key_code; // key held by the terminal frontend, or CHIP8_KEY_CODE_NO_KEY
+  uint8_t redraw;
+  uint8_t reserved[3];
+  uint64_t loop_counter; // frames run, the phase of work done every few frames
+  uint64_t key_code_loop; // frame the held key was last seen
+
+  uint8_t display[DISPLAY_BYTES];
+
+  // only the chunks in written_chunks are saved and loaded
+  uint8_t memory[CHIP8_MEMORY_SIZE];
+};
+
+#define SAVESTATE_HEADER_SIZE offsetof(struct savestate, memory)
+#define SAVESTATE_CHUNK_SIZE (1 << CHIP8_DIRTY_CHUNK_SHIFT)
+
+// fails to compile if the compiler padded the fixed part
+typedef char savestate_no_padding[SAVESTATE_HEADER_SIZE == 400 ? 1 : -1];
+
+// Bytes of memory a state with these written chunks has on disk.
+size_t savestate_memory_size(uint64_t written_chunks) {
+  size_t chunks = 0;
+  for (; written_chunks != 0; written_chunks >>= 1) {
+    chunks += written_chunks & 1;
+  }
+  return chunks * SAVESTATE_CHUNK_SIZE;
+}
+
+// Records the program chip8 was just initialized from, program_len bytes at
+// PROGRAM_START_ADDRESS, and its timing mode, for savestate_load() to check.
+void savestate_init(struct savestate *state, struct chip8 *chip8, size_t program_len) {
+  state->program_len = program_len;
+  state->program_hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < program_len; i++) {
+    state->program_hash = (state->program_hash ^ chip8_read(chip8, PROGRAM_START_ADDRESS + i)) * 0x100000001b3ull;
+  }
+  state->accurate_timing = chip8->accurate_timing;
+}
+
+// Fills state, set up by savestate_init(), from file. Returns false if there
+// is no file, or if it was written by another version. Exits if it was saved
+// from another program or in the other timing mode, rather than let the next
+// save replace it.
+bool savestate_load(char *file, struct savestate *state) {
+  int fd = open(file, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size < (off_t)SAVESTATE_HEADER_SIZE || st.st_size > (off_t)sizeof *state) {
+    close(fd);
+    return false;
+  }
+  uint8_t *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+  struct savestate header;
+  memcpy(&header, mapped, SAVESTATE_HEADER_SIZE);
+  bool valid = memcmp(header.magic, SAVESTATE_MAGIC, sizeof header.magic) == 0 &&
+    header.version == SAVESTATE_VERSION && header.size == SAVESTATE_HEADER_SIZE &&
+    (size_t)st.st_size == SAVESTATE_HEADER_SIZE + savestate_memory_size(header.written_chunks);
+  if (valid && (header.program_len != state->program_len || header.program_hash != state->program_hash)) {
+    fprintf(stderr, "%s was saved from another program\n", file);
+    exit(1);
+  }
+  if (valid && header.accurate_timing != state->accurate_timing) {
+    fprintf(stderr, "%s was saved %s -a\n", file, header.accurate_timing ? "with" : "without");
+    exit(1);
+  }
+  if (valid) {
+    memcpy(state, &header, SAVESTATE_HEADER_SIZE);
+    uint8_t *chunk = mapped + SAVESTATE_HEADER_SIZE;
+    uint64_t written = state->written_chunks;
+    for (size_t address = 0; written != 0; address += SAVESTATE_CHUNK_SIZE, written >>= 1) {
+      if (written & 1) {
+        memcpy(&state->memory[address], chunk, SAVESTATE_CHUNK_SIZE);
+        chunk += SAVESTATE_CHUNK_SIZE;
+      }
+    }
+  }
+  munmap(mapped, st.st_size);
+  return valid;
+}
+
+void savestate_capture(struct savestate *state, struct chip8 *chip8) {
+  state->rand_state = chip8->rand_state;
+  state->cycles = chip8->cycles;
+  state->dt_set_at = chip8->dt_set_at;
+  state->st_set_at = chip8->st_set_at;
+  state->written_chunks = chip8->written_chunks;
+  memcpy(state->stack, chip8->stack, sizeof state->stack);
+  state->pc = chip8->pc;
+  state->i = chip8->i;
+  state->keys_currently_pressed = chip8->keys_currently_pressed;
+  memcpy(state->v, chip8->v, sizeof state->v);
+  state->sp = chip8->sp;
+  state->dt = chip8->dt;
+  state->st = chip8->st;
+  state->last_key_released_event = chip8->last_key_released_event;
+  state->accurate_timing = chip8->accurate_timing;
+  memcpy(state->display, chip8->display, sizeof state->display);
+  uint64_t written = chip8->written_chunks;
+  for (size_t address = 0; written != 0; address += SAVESTATE_CHUNK_SIZE, written >>= 1) {
+    if (written & 1) {
+      chip8_read_block(chip8, address, &state->memory[address], SAVESTATE_CHUNK_SIZE);
+    }
+  }
+}
+
+// Puts a loaded state into chip8, initialized from the program it was saved
+// from. Only the chunks that differ from it are copied.
+void savestate_apply(struct savestate *state, struct chip8 *chip8) {
+  uint64_t written = state->written_chunks;
+  for (size_t address = 0; written != 0; address += SAVESTATE_CHUNK_SIZE, written >>= 1) {
+    if ((written & 1) && !chip8_memory_equals(chip8, address, &state->memory[address], SAVESTATE_CHUNK_SIZE)) {
+      chip8_write_block(chip8, address, &state->memory[address], SAVESTATE_CHUNK_SIZE);
+    }
+  }
+  chip8->written_chunks |= state->written_chunks;
+  chip8->rand_state = state->rand_state;
+  chip8->cycles = state->cycles;
+  chip8->dt_set_at = state->dt_set_at;
+  chip8->st_set_at = state->st_set_at;
+  memcpy(chip8->stack, state->stack, sizeof chip8->stack);
+  chip8->pc = state->pc;
+  chip8->i = state->i;
+  chip8->keys_currently_pressed = state->keys_currently_pressed;
+  memcpy(chip8->v, state->v, sizeof chip8->v);
+  chip8->sp = state->sp;
+  chip8->dt = state->dt;
+  chip8->st = state->st;
+  chip8->last_key_released_event = state->last_key_released_event;
+  chip8->accurate_timing = state->accurate_timing;
+  memcpy(chip8->display, state->display, sizeof chip8->display);
+}
+
+// Writes state to file, replacing it only once the new state is on disk so a
+// crash while saving leaves the previous one. Returns false with errno set on
+// failure.
+bool savestate_save(char *file, struct savestate *state) {
+  memcpy(state->magic, SAVESTATE_MAGIC, sizeof state->magic);
+  state->version = SAVESTATE_VERSION;
+  state->size = SAVESTATE_HEADER_SIZE;
+  memset(state->reserved, 0, sizeof state->reserved);
+
+  uint8_t data[sizeof *state];
+  memcpy(data, state, SAVESTATE_HEADER_SIZE);
+  size_t len = SAVESTATE_HEADER_SIZE;
+  uint64_t written_chunks = state->written_chunks;
+  for (size_t address = 0; written_chunks != 0; address += SAVESTATE_CHUNK_SIZE, written_chunks >>= 1) {
+    if (written_chunks & 1) {
+      memcpy(data + len, &state->memory[address], SAVESTATE_CHUNK_SIZE);
+      len += SAVESTATE_CHUNK_SIZE;
+    }
+  }
+
+  char tmp[4096];
+  if (snprintf(tmp, sizeof tmp, "%s.tmp", file) >= (int)sizeof tmp) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    return false;
+  }
+  size_t written = 0;
+  while (written < len) {
+    ssize_t result = write(fd, data + written, len - written);
+    if (result == -1 && errno == EINTR) {
+      continue;
+    }
+    if (result == -1) {
+      close(fd);
+      return false;
+    }
+    written += result;
+  }
+  if (fsync(fd) == -1 || close(fd) == -1) {
+    return false;
+  }
+  return rename(tmp, file) == 0;
+}
@@ -1,14 +1,63 @@
-#include <stdlib.h> // rand
-#define CHIP8_RAND rand
+#define _POSIX_C_SOURCE 200809L // getopt
+#define CHIP8_RAND chip8_rand
 #include "chip8.c"
+#include "savestate.c"
+#ifdef CHIP8_AOT
+#include CHIP8_AOT
+#endif
 
 #include <SDL.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #define SCREEN_WIDTH 640
 #define SCREEN_HEIGHT 320
 
+#define SAVE_EVERY_LOOPS 60
+#define FRAME_MILLISECONDS (1000 / 60)
+
+#define INPUT_QUEUE_LEN 64
+// Emulation runs this far behind the clock, so events stamped when they are
+// pumped, at most a millisecond after they come in, are queued before the
+// instruction due at their timestamp runs.
+#define INPUT_DELAY_MILLISECONDS 2
+
+// A key transition, applied at the instruction that runs at its timestamp.
+struct input_event {
+  Uint32 timestamp;
+  uint8_t key_code;
+  bool down;
+};
+
+// The emulator runs on its own thread, so it keeps time while the main thread
+// presents. The main thread owns the window and its events and hands key
+// transitions over through input; frames come back through display.
+struct emulator {
+  struct chip8 chip8;
+  char *save_file;
+  struct savestate state;
+  uint64_t loop_counter;
+  SDL_atomic_t done;
+
+  SDL_mutex *input_mutex;
+  struct input_event input[INPUT_QUEUE_LEN];
+  size_t input_head;
+  size_t input_len;
+
+  SDL_mutex *display_mutex;
+  uint8_t display[DISPLAY_BYTES];
+  bool display_updated;
+
+  // saves are written by their own thread, as fsync can take a while
+  SDL_mutex *save_mutex;
+  SDL_cond *save_cond;
+  struct savestate save; // captured, waiting to be written
+  bool save_pending;
+  bool save_done; // no more saves will come
+};
+
 void die(char *s) {
   perror(s);
   exit(1);
@@ -29,23 +78,218 @@ size_t read_file(char *file, uint8_t *buffer, size_t buffer_len) {
   return bytes_read;
 }
 
+// Keeps only the last transition of every key, in order, which leaves every
+// key in the state it ends up in and at most 16 events in the queue.
+void input_coalesce(struct emulator *emu) {
+  struct input_event kept[INPUT_QUEUE_LEN];
+  size_t kept_len = 0;
+  uint16_t is_kept = 0;
+  for (size_t n = emu->input_len; n > 0; n--) {
+    struct input_event event = emu->input[(emu->input_head + n - 1) % INPUT_QUEUE_LEN];
+    if (!(is_kept & (1 << event.key_code))) {
+      is_kept |= 1 << event.key_code;
+      kept[kept_len++] = event;
+    }
+  }
+  for (size_t n = 0; n < kept_len; n++) {
+    emu->input[n] = kept[kept_len - 1 - n];
+  }
+  emu->input_head = 0;
+  emu->input_len = kept_len;
+}
+
+void input_push(struct emulator *emu, struct input_event event) {
+  SDL_LockMutex(emu->input_mutex);
+  // when the emulator falls this far behind, only where keys end up counts
+  if (emu->input_len == INPUT_QUEUE_LEN) {
+    input_coalesce(emu);
+  }
+  emu->input[(emu->input_head + emu->input_len) % INPUT_QUEUE_LEN] = event;
+  emu->input_len++;
+  SDL_UnlockMutex(emu->input_mutex);
+}
+
+// Applies the key transitions that happened by time. It stops after a key
+// press, so a press and release in quick succession still leave the key down
+// for at least one instruction.
+void input_apply(struct emulator *emu, Uint32 time) {
+  SDL_LockMutex(emu->input_mutex);
+  while (emu->input_len > 0) {
+    struct input_event event = emu->input[emu->input_head];
+    if (!SDL_TICKS_PASSED(time, event.timestamp)) {
+      break;
+    }
+    emu->input_head = (emu->input_head + 1) % INPUT_QUEUE_LEN;
+    emu->input_len--;
+    if (event.down) {
+      chip8_key_code_down(&emu->chip8, event.key_code);
+      break;
+    }
+    chip8_key_code_up(&emu->chip8, event.key_code);
+  }
+  SDL_UnlockMutex(emu->input_mutex);
+}
+
+// Milliseconds into the frame at which the next instruction is due.
+Uint32 instruction_offset(struct chip8 *chip8, uint64_t frame_end, int executed) {
+  if (chip8->accurate_timing) {
+    uint64_t frame_start = frame_end - CHIP8_CYCLES_PER_FRAME;
+    return (chip8->cycles - frame_start) * FRAME_MILLISECONDS / CHIP8_CYCLES_PER_FRAME;
+  }
+  return executed * FRAME_MILLISECONDS / CHIP8_INSTRUCTIONS_PER_FRAME;
+}
+
+// Hands the current state to save_thread(). A save that was not written yet
+// is replaced.
+void emulator_save(struct emulator *emu) {
+  savestate_capture(&emu->state, &emu->chip8);
+  emu->state.loop_counter = emu->loop_counter;
+  SDL_LockMutex(emu->save_mutex);
+  emu->save = emu->state;
+  emu->save_pending = true;
+  SDL_CondSignal(emu->save_cond);
+  SDL_UnlockMutex(emu->save_mutex);
+}
+
+int save_thread(void *data) {
+  struct emulator *emu = data;
+  static struct savestate state;
+  SDL_LockMutex(emu->save_mutex);
+  for (;;) {
+    while (!emu->save_pending && !emu->save_done) {
+      SDL_CondWait(emu->save_cond, emu->save_mutex);
+    }
+    if (!emu->save_pending) {
+      break;
+    }
+    state = emu->save;
+    emu->save_pending = false;
+    SDL_UnlockMutex(emu->save_mutex);
+    if (!savestate_save(emu->save_file, &state)) {
+      die("savestate_save");
+    }
+    SDL_LockMutex(emu->save_mutex);
+  }
+  SDL_UnlockMutex(emu->save_mutex);
+  return 0;
+}
+
+int emulator_thread(void *data) {
+  struct emulator *emu = data;
+  struct chip8 *chip8 = &emu->chip8;
+  bool redraw = true;
+
+  Uint32 frame_start = SDL_GetTicks();
+  while (!SDL_AtomicGet(&emu->done)) {
+    emu->loop_counter++;
+
+    chip8_60hz_timer(chip8);
+
+#ifdef CHIP8_AOT
+    // compiled code runs a frame at once, so input is applied per frame
+    Uint32 now = SDL_GetTicks();
+    if (!SDL_TICKS_PASSED(now, frame_start + INPUT_DELAY_MILLISECONDS)) {
+      SDL_Delay(frame_start + INPUT_DELAY_MILLISECONDS - now);
+    }
+    input_apply(emu, frame_start);
+    chip8_aot_run_frame(chip8, &redraw);
+#else
+    // spread the frame's instructions over the frame
+    uint64_t frame_end = chip8_frame_end(chip8);
+    struct cycle_result res = {0};
+    for (int i = 0; !chip8_frame_done(chip8, frame_end, i); i++) {
+      Uint32 due = frame_start + instruction_offset(chip8, frame_end, i);
+      Uint32 now = SDL_GetTicks();
+      if (!SDL_TICKS_PASSED(now, due + INPUT_DELAY_MILLISECONDS)) {
+        SDL_Delay(due + INPUT_DELAY_MILLISECONDS - now);
+      }
+      input_apply(emu, due);
+      cycle(chip8, &res);
+      redraw |= res.redraw_needed;
+    }
+#endif
+
+    if (redraw) {
+      SDL_LockMutex(emu->display_mutex);
+      memcpy(emu->display, chip8->display, sizeof emu->display);
+      emu->display_updated = true;
+      SDL_UnlockMutex(emu->display_mutex);
+      redraw = false;
+    }
+
+    if (emu->save_file != NULL && emu->loop_counter % SAVE_EVERY_LOOPS == 0) {
+      emulator_save(emu);
+    }
+
+    frame_start += FRAME_MILLISECONDS;
+    // do not try to catch up after the process was stopped for a while
+    if (SDL_TICKS_PASSED(SDL_GetTicks(), frame_start + 10 * FRAME_MILLISECONDS)) {
+      frame_start = SDL_GetTicks();
+    }
+  }
+
+  if (emu->save_file != NULL) {
+    emulator_save(emu);
+  }
+  return 0;
+}
+
 int main(int argc, char **argv) {
-  if (argc < 2){
+  bool accurate_timing = false;
+  char *save_file = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "as:")) != -1) {
+    switch (opt) {
+      case 'a':
+        accurate_timing = true;
+        break;
+      case 's':
+        save_file = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-a] [-s save state] program\n", argv[0]);
+        exit(1);
+    }
+  }
+  if (optind >= argc) {
     fprintf(stderr, "specify a program to run\n");
     exit(1);
   }
-  char *file = argv[1];
+  char *file = argv[optind];
 
-  struct chip8 chip8 = {0};
-  chip8_init(&chip8);
+  struct chip8_image image = {0};
+  chip8_image_init(&image);
   // load the ROM
-  read_file(file, &chip8.memory[PROGRAM_START_ADDRESS], (sizeof chip8.memory) - PROGRAM_START_ADDRESS);
+  size_t program_len = read_file(file, &image.memory[PROGRAM_START_ADDRESS], (sizeof image.memory) - PROGRAM_START_ADDRESS);
+  //image.memory[0x1FF] = 1; // IBM
+  //image.memory[0x1FF] = 2; // opcodes
+  //image.memory[0x1FF] = 3; // flags
+
+  static struct emulator emu;
+  chip8_init(&emu.chip8, &image);
+  emu.chip8.accurate_timing = accurate_timing;
+  emu.save_file = save_file;
+#ifdef CHIP8_AOT
+  if (!chip8_aot_matches(&emu.chip8)) {
+    fprintf(stderr, "%s is not the program that was compiled in\n", file);
+    exit(1);
+  }
+#endif
+
+  // carry on from the last save
+  savestate_init(&emu.state, &emu.chip8, program_len);
+  if (save_file != NULL && savestate_load(save_file, &emu.state)) {
+    savestate_apply(&emu.state, &emu.chip8);
+    emu.loop_counter = emu.state.loop_counter;
+  }
 
   SDL_Init(SDL_INIT_VIDEO);
   SDL_Window * window = SDL_CreateWindow("CHIP-8", SDL_WINDOWPOS_UNDEFINED,
                                          SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, 0);
 
-  SDL_Renderer * renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+  // SDL stamps events when they are pumped, which is on this thread, so it
+  // does not wait for vsync; the emulator paces the frames
+  SDL_Renderer * renderer = SDL_CreateRenderer(window, -1, 0);
   int width = SCREEN_WIDTH;
   int height = SCREEN_HEIGHT;
 
@@ -53,42 +297,64 @@ int main(int argc, char **argv) {
   SDL_RenderSetLogicalSize(renderer, width, height);
   SDL_RenderSetIntegerScale(renderer, 1);
 
+  uint8_t pixels[DISPLAY_BYTES] = {0};
   SDL_Surface * surface = SDL_CreateRGBSurfaceWithFormat(SDL_SWSURFACE,
                                                          DISPLAY_COLS, DISPLAY_ROWS, 1, SDL_PIXELFORMAT_INDEX1MSB);
   SDL_Color colors[2] = {{0, 0, 0, 255}, {255, 255, 255, 255}};
   SDL_SetPaletteColors(surface->format->palette, colors, 0, 2);
-  surface->pixels = &chip8.display;
+  surface->pixels = pixels;
+
+  emu.input_mutex = SDL_CreateMutex();
+  emu.display_mutex = SDL_CreateMutex();
+  emu.save_mutex = SDL_CreateMutex();
+  emu.save_cond = SDL_CreateCond();
+  SDL_Thread *saver = NULL;
+  if (save_file != NULL) {
+    saver = SDL_CreateThread(save_thread, "save", &emu);
+    if (saver == NULL) {
+      fprintf(stderr, "SDL_CreateThread: %s\n", SDL_GetError());
+      exit(1);
+    }
+  }
+  SDL_Thread *thread = SDL_CreateThread(emulator_thread, "emulator", &emu);
+  if (thread == NULL) {
+    fprintf(stderr, "SDL_CreateThread: %s\n", SDL_GetError());
+    exit(1);
+  }
 
   bool done = false;
   SDL_Event event;
-  int f = 60;
-
-  bool redraw = false;
 
   while (!done) {
-    Uint32 start = SDL_GetTicks();
-
-    while (SDL_PollEvent(&event) ) {
-      if (event.type == SDL_QUIT) {
-        done = true;
-      }
-      if (event.type == SDL_KEYDOWN) {
-        char c = event.key.keysym.sym;
-        chip8_key_code_down(&chip8, chip8_key_to_key_code(c));
-      }
-      if (event.type == SDL_KEYUP) {
-        char c = event.key.keysym.sym;
-        chip8_key_code_up(&chip8, chip8_key_to_key_code(c));
-      }
+    // wake up for events as they come in, and at least every millisecond to
+    // present new frames
+    if (SDL_WaitEventTimeout(&event, 1)) {
+      do {
+        if (event.type == SDL_QUIT) {
+          done = true;
+        }
+        if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) {
+          char c = event.key.keysym.sym;
+          struct input_event input = {
+            .timestamp = event.key.timestamp,
+            .key_code = chip8_key_to_key_code(c),
+            .down = event.type == SDL_KEYDOWN,
+          };
+          // held keys repeat, but only the first press is a transition
+          if (input.key_code != CHIP8_KEY_CODE_NO_KEY && !event.key.repeat) {
+            input_push(&emu, input);
+          }
+        }
+      } while (SDL_PollEvent(&event));
     }
 
-    chip8_60hz_timer(&chip8);
-
-    struct cycle_result res = {0};
-    for (int i = 0; i < 30; i++) {
-      cycle(&chip8, &res);
-      redraw |= res.redraw_needed;
+    SDL_LockMutex(emu.display_mutex);
+    bool redraw = emu.display_updated;
+    if (redraw) {
+      memcpy(pixels, emu.display, sizeof pixels);
+      emu.display_updated = false;
     }
+    SDL_UnlockMutex(emu.display_mutex);
 
     if (redraw) {
       SDL_RenderClear(renderer);
@@ -96,17 +362,26 @@ int main(int argc, char **argv) {
       SDL_RenderCopy(renderer, screen_texture, NULL, NULL);
       SDL_RenderPresent(renderer);
       SDL_DestroyTexture(screen_texture);
-      redraw = false;
     }
+  }
 
-    Uint32 end = SDL_GetTicks();
-    int wait_for = 1000 / f - (end - start);
-    if (wait_for > 0) {
-      SDL_Delay(wait_for);
-    }
+  SDL_AtomicSet(&emu.done, 1);
+  SDL_WaitThread(thread, NULL);
+  if (saver != NULL) {
+    // write the save made on the way out
+    SDL_LockMutex(emu.save_mutex);
+    emu.save_done = true;
+    SDL_CondSignal(emu.save_cond);
+    SDL_UnlockMutex(emu.save_mutex);
+    SDL_WaitThread(saver, NULL);
   }
+  SDL_DestroyMutex(emu.input_mutex);
+  SDL_DestroyMutex(emu.display_mutex);
+  SDL_DestroyMutex(emu.save_mutex);
+  SDL_DestroyCond(emu.save_cond);
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
   SDL_Quit();
+  chip8_free(&emu.chip8);
   return 0;
 }
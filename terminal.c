@@ -1,8 +1,13 @@
-#include <stdlib.h> // rand
-#define CHIP8_RAND rand
+#define _POSIX_C_SOURCE 200809L // getopt, nanosleep
+#define CHIP8_RAND chip8_rand
 #include "chip8.c"
+#include "savestate.c"
+#ifdef CHIP8_AOT
+#include CHIP8_AOT
+#endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -12,6 +17,8 @@
 #include <time.h>
 #include <errno.h>
 
+#define SAVE_EVERY_LOOPS 60
+
 struct termios orig_termios;
 
 void die(char *s) {
@@ -94,152 +101,73 @@ void draw(struct chip8 *chip8) {
 }
 
 void print_instruction(struct instruction *instr) {
-  // last 12 bit
-  uint16_t nnn = ((instr->value[0] & 0xf) << 8) | instr->value[1];
-
-  // last byte
-  uint8_t nn = instr->value[1];
-
-  // 4 bit nibbles, excluding the first nibble because it never contains operands
-  uint8_t x = instr->value[0] & 0xf;
-  uint8_t y = instr->value[1] >> 4 & 0xf;
-  uint8_t n = instr->value[1] & 0xf;
-
-  switch (instr->operation) {
-    case OP_00E0:
-      fprintf(stderr, "CLS\n");
-      break;
-    case OP_00EE:
-      fprintf(stderr, "RET\n");
-      break;
-    case OP_0NNN:
-      fprintf(stderr, "SYS\n");
-      break;
-    case OP_1NNN:
-      fprintf(stderr, "JP %03x\n", nnn); // jump to address
-      break;
-    case OP_2NNN:
-      fprintf(stderr, "CALL %03x\n", nnn); // execute subroutine
-      break;
-    case OP_3XNN:
-      fprintf(stderr, "SEV V%01x %02x\n", x, nn); // skip if equal
-      break;
-    case OP_4XNN:
-      fprintf(stderr, "SNE V%01x %02x\n", x, nn); // skip if not equal
-      break;
-    case OP_5XY0:
-      fprintf(stderr, "SE V%01x V%01x\n", x, y); // skip if equal
-      break;
-    case OP_6XNN:
-      fprintf(stderr, "LD V%01x %02x\n", x, nn); // load in register
-      break;
-    case OP_7XNN:
-      fprintf(stderr, "ADD V%01x %02x\n", x, nn); // add constant
-      break;
-    case OP_8XY0:
-      fprintf(stderr, "LD V%01x V%01x\n", x, y);
-      break;
-    case OP_8XY1:
-      fprintf(stderr, "OR V%01x V%01x\n", x, y);
-      break;
-    case OP_8XY2:
-      fprintf(stderr, "AND V%01x V%01x\n", x, y);
-      break;
-    case OP_8XY3:
-      fprintf(stderr, "XOR V%01x V%01x\n", x, y);
-      break;
-    case OP_8XY4:
-      fprintf(stderr, "ADD V%01x V%01x\n", x, y);
-      break;
-    case OP_8XY5:
-      fprintf(stderr, "SUB V%01x V%01x\n", x, y);
-      break;
-    case OP_8XY6:
-      fprintf(stderr, "SHR V%01x V%01x\n", x, y);
-      break;
-    case OP_8XY7:
-      fprintf(stderr, "SUBN V%01x V%01x\n", x, y);
-      break;
-    case OP_8XYE:
-      fprintf(stderr, "SHL V%01x V%01x\n", x, y);
-      break;
-    case OP_9XY0:
-      fprintf(stderr, "SNE V%01x V%01x\n", x, y);
-      break;
-    case OP_ANNN:
-      fprintf(stderr, "LD I, %03x\n", nnn); // load NNN in register I
-      break;
-    case OP_BNNN:
-      fprintf(stderr, "JP V0, %03x\n", nnn); // jump to V0 + NNN
-      break;
-    case OP_CXNN:
-      fprintf(stderr, "RND V%01x, %02x\n", x, nn); // Set VX to a random number with a mask of NN
-      break;
-    case OP_DXYN:
-      fprintf(stderr, "DRW V%01x V%01x %01x\n", x, y, n);
-      break;
-    case OP_EX9E:
-      fprintf(stderr, "SKP V%01x\n", x);
-      break;
-    case OP_EXA1:
-      fprintf(stderr, "SKNP V%01x\n", x);
-      break;
-    case OP_FX07:
-      fprintf(stderr, "LD V%01x, DT\n", x);
-      break;
-    case OP_FX0A:
-      fprintf(stderr, "LD V%01x, K\n", x);
-      break;
-    case OP_FX15:
-      fprintf(stderr, "LD DT, V%01x\n", x);
-      break;
-    case OP_FX18:
-      fprintf(stderr, "LD ST, V%01x\n", x);
-      break;
-    case OP_FX1E:
-      fprintf(stderr, "ADD I, V%01x\n", x);
-      break;
-    case OP_FX29:
-      fprintf(stderr, "LD F, V%01x\n", x);
-      break;
-    case OP_FX33:
-      fprintf(stderr, "LD B, V%01x\n", x);
-      break;
-    case OP_FX55:
-      fprintf(stderr, "LD [I], V%01x\n", x);
-      break;
-    case OP_FX65:
-      fprintf(stderr, "LD V%01x, [I]\n", x);
-      break;
-    default:
-      fprintf(stderr, "UNKNOWN %02x%02x\n", instr->value[0], instr->value[1]);
-  }
+  char text[32];
+  chip8_disassemble(instr, text, sizeof text);
+  fprintf(stderr, "%s\n", text);
 }
 
 int main(int argc, char **argv) {
-  if (argc < 2){
+  bool accurate_timing = false;
+  char *save_file = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "as:")) != -1) {
+    switch (opt) {
+      case 'a':
+        accurate_timing = true;
+        break;
+      case 's':
+        save_file = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-a] [-s save state] program\n", argv[0]);
+        exit(1);
+    }
+  }
+  if (optind >= argc) {
     fprintf(stderr, "specify a program to run\n");
     exit(1);
   }
-  char *file = argv[1];
+  char *file = argv[optind];
 
-  struct chip8 chip8 = {0};
-  chip8_init(&chip8);
+  struct chip8_image image = {0};
+  chip8_image_init(&image);
   // load the ROM
-  read_file(file, &chip8.memory[PROGRAM_START_ADDRESS], (sizeof chip8.memory) - PROGRAM_START_ADDRESS);
-  //chip8.memory[0x1FF] = 1; // IBM
-  //chip8.memory[0x1FF] = 2; // opcodes
-  //chip8.memory[0x1FF] = 3; // flags
-
-  enableRawMode();
+  size_t program_len = read_file(file, &image.memory[PROGRAM_START_ADDRESS], (sizeof image.memory) - PROGRAM_START_ADDRESS);
+  //image.memory[0x1FF] = 1; // IBM
+  //image.memory[0x1FF] = 2; // opcodes
+  //image.memory[0x1FF] = 3; // flags
 
-  puts("\x1b[?1049h");
+  struct chip8 chip8 = {0};
+  chip8_init(&chip8, &image);
+  chip8.accurate_timing = accurate_timing;
+#ifdef CHIP8_AOT
+  if (!chip8_aot_matches(&chip8)) {
+    fprintf(stderr, "%s is not the program that was compiled in\n", file);
+    exit(1);
+  }
+#endif
 
   uint8_t key_code = CHIP8_KEY_CODE_NO_KEY;
   uint64_t key_code_loop = 0;
   bool redraw = false;
 
   uint64_t loop_counter = 0;
+
+  // carry on from the last save
+  struct savestate state = {0};
+  savestate_init(&state, &chip8, program_len);
+  if (save_file != NULL && savestate_load(save_file, &state)) {
+    savestate_apply(&state, &chip8);
+    loop_counter = state.loop_counter;
+    key_code_loop = state.key_code_loop;
+    key_code = state.key_code;
+    redraw = state.redraw;
+  }
+
+  enableRawMode();
+
+  puts("\x1b[?1049h");
+
   for (;;) {
     loop_counter++;
 
@@ -260,12 +188,18 @@ int main(int argc, char **argv) {
 
     chip8_60hz_timer(&chip8);
 
+#ifdef CHIP8_AOT
+    // compiled code does not report single instructions
+    chip8_aot_run_frame(&chip8, &redraw);
+#else
+    uint64_t frame_end = chip8_frame_end(&chip8);
     struct cycle_result res = {0};
-    for (int i = 0; i < 30; i++) {
+    for (int i = 0; !chip8_frame_done(&chip8, frame_end, i); i++) {
       cycle(&chip8, &res);
       redraw |= res.redraw_needed;
       print_instruction(&res.instr);
     }
+#endif
 
     if (redraw && loop_counter % 5 == 0) {
       draw(&chip8);
@@ -278,6 +212,17 @@ int main(int argc, char **argv) {
       key_code = CHIP8_KEY_CODE_NO_KEY;
     }
 
+    if (save_file != NULL && loop_counter % SAVE_EVERY_LOOPS == 0) {
+      savestate_capture(&state, &chip8);
+      state.loop_counter = loop_counter;
+      state.key_code_loop = key_code_loop;
+      state.key_code = key_code;
+      state.redraw = redraw;
+      if (!savestate_save(save_file, &state)) {
+        die("savestate_save");
+      }
+    }
+
     sleep_milliseconds(16);
   }
   puts("\x1b[?1049l");
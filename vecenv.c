@@ -0,0 +1,378 @@
+#define _GNU_SOURCE // memfd_create, syscall
+#define CHIP8_RAND chip8_rand
+#include "chip8.c"
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Runs many chip8 instances side by side for training agents. What controllers
+// read and write is kept in a memfd that other processes can mmap (through the
+// /proc path printed on startup). Workers copy the observations of each
+// instance into its slot at the end of a step.
+//
+// Protocol for the controlling process, per step:
+//   1. write keys (and reset when wanted) into every slot
+//   2. atomically increment header.step_seq and FUTEX_WAKE it
+//   3. FUTEX_WAIT on header.done_seq until it equals the new step_seq
+//   4. read display, reward[] and done (and memory with -m) from every slot
+// Setting header.shutdown and bumping step_seq stops the workers.
+//
+// The instances themselves hold pointers into this process and stay in its
+// private memory; a slot only has copies of what controllers read.
+
+#define VECENV_MAGIC 0x38504843 // "CHP8"
+#define VECENV_VERSION 3
+#define VECENV_MAX_REWARDS 8
+#define VECENV_MAX_THREADS 256
+#define VECENV_SLOT_ALIGN 64 // keep slots on separate cache lines
+
+struct vecenv_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_envs;
+  uint32_t num_rewards;
+  uint32_t slot_offset; // offset of the first slot from the start of the region
+  uint32_t slot_size; // distance between two slots
+  uint32_t display_offset; // offset of display inside a slot
+  uint32_t memory_offset; // offset of memory inside a slot, 0 without -m
+  uint32_t step_seq; // futex, bumped by the controller
+  uint32_t done_seq; // futex, set to step_seq by the workers when done
+  uint32_t shutdown;
+};
+
+struct vecenv_slot {
+  // inputs
+  uint16_t keys; // bits for held keys, same layout as keys_currently_pressed
+  uint8_t reset;
+
+  // outputs
+  uint8_t done;
+  int16_t reward[VECENV_MAX_REWARDS]; // change of each reward byte over the step
+  uint8_t display[DISPLAY_BYTES];
+  // with -m followed by a copy of memory
+};
+
+// What the workers keep for a slot.
+struct vecenv_instance {
+  struct chip8 chip8;
+  uint8_t reward_prev[VECENV_MAX_REWARDS];
+};
+
+struct vecenv {
+  struct vecenv_header *header;
+  uint8_t *slots;
+  struct vecenv_instance *instances;
+  struct chip8_image image; // shared by all instances
+  struct chip8 initial;
+  uint16_t reward_addresses[VECENV_MAX_REWARDS];
+  int16_t done_address; // -1 when not used
+  bool mirror_memory;
+  uint32_t seed; // of the random numbers of instance 0, the others follow
+  int cycles_per_step;
+  int num_threads;
+  uint32_t workers_finished;
+};
+
+struct vecenv_worker {
+  struct vecenv *env;
+  uint32_t first;
+  uint32_t last;
+};
+
+void die(char *s) {
+  perror(s);
+  exit(1);
+}
+
+size_t read_file(char *file, uint8_t *buffer, size_t buffer_len) {
+  FILE *f = fopen(file, "r");
+  if (f == NULL) {
+    die("fopen");
+  }
+  size_t bytes_read = fread(buffer, sizeof *buffer, buffer_len, f);
+  if (!feof(f)) {
+    die("fread");
+  }
+  if (fclose(f) != 0) {
+    die("fclose");
+  }
+  return bytes_read;
+}
+
+// Futexes live in memory shared with other processes, so no FUTEX_PRIVATE_FLAG.
+void futex_wait(uint32_t *addr, uint32_t val) {
+  if (syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0) == -1 && errno != EAGAIN && errno != EINTR) {
+    die("futex");
+  }
+}
+
+void futex_wake(uint32_t *addr) {
+  if (syscall(SYS_futex, addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0) == -1) {
+    die("futex");
+  }
+}
+
+struct vecenv_slot *vecenv_slot(struct vecenv *env, uint32_t n) {
+  return (struct vecenv_slot *)(env->slots + (size_t)n * env->header->slot_size);
+}
+
+// The copy of memory in slot n, or NULL without -m.
+uint8_t *vecenv_slot_memory(struct vecenv *env, uint32_t n) {
+  if (!env->mirror_memory) {
+    return NULL;
+  }
+  return (uint8_t *)vecenv_slot(env, n) + env->header->memory_offset;
+}
+
+// Starts the instance over. Its random numbers go on where they were, so that
+// episodes do not all see the same ones.
+void vecenv_reset(struct vecenv *env, uint32_t n) {
+  struct vecenv_slot *slot = vecenv_slot(env, n);
+  struct vecenv_instance *instance = &env->instances[n];
+  uint32_t rand_state = instance->chip8.rand_state;
+  chip8_restore(&instance->chip8, &env->initial);
+  instance->chip8.rand_state = rand_state;
+  slot->keys = 0;
+  slot->reset = 0;
+  slot->done = 0;
+  for (uint32_t r = 0; r < env->header->num_rewards; r++) {
+    slot->reward[r] = 0;
+    instance->reward_prev[r] = chip8_read(&instance->chip8, env->reward_addresses[r]);
+  }
+  memcpy(slot->display, instance->chip8.display, sizeof slot->display);
+  uint8_t *memory = vecenv_slot_memory(env, n);
+  if (memory != NULL) {
+    chip8_read_block(&instance->chip8, 0, memory, CHIP8_MEMORY_SIZE);
+  }
+}
+
+// Copies the display to slot n, and with -m the memory chunks written since
+// the reset.
+void vecenv_publish(struct vecenv *env, uint32_t n, struct chip8 *chip8) {
+  memcpy(vecenv_slot(env, n)->display, chip8->display, DISPLAY_BYTES);
+  uint8_t *memory = vecenv_slot_memory(env, n);
+  if (memory == NULL) {
+    return;
+  }
+  size_t chunk_size = 1 << CHIP8_DIRTY_CHUNK_SHIFT;
+  uint64_t written = chip8->written_chunks;
+  for (size_t chunk = 0; written != 0; chunk++, written >>= 1) {
+    if (written & 1) {
+      size_t address = chunk * chunk_size;
+      memcpy(&memory[address], &chip8->pages[address >> CHIP8_PAGE_SHIFT][address & (CHIP8_PAGE_SIZE - 1)], chunk_size);
+    }
+  }
+}
+
+void vecenv_step(struct vecenv *env, uint32_t n) {
+  struct vecenv_slot *slot = vecenv_slot(env, n);
+  struct vecenv_instance *instance = &env->instances[n];
+  if (slot->reset) {
+    vecenv_reset(env, n);
+  }
+  if (slot->done) {
+    return;
+  }
+  struct chip8 *chip8 = &instance->chip8;
+
+  uint16_t released = chip8->keys_currently_pressed & ~slot->keys;
+  for (uint8_t key_code = 0; key_code < 16; key_code++) {
+    if (released & (1 << key_code)) {
+      chip8_key_code_up(chip8, key_code);
+    }
+  }
+  chip8->keys_currently_pressed = slot->keys;
+
+  chip8_60hz_timer(chip8);
+
+  struct cycle_result res = {0};
+  for (int i = 0; i < env->cycles_per_step; i++) {
+    uint16_t pc = chip8->pc;
+    cycle(chip8, &res);
+    // a jump to itself is how most programs halt
+    if (chip8->pc == pc && res.instr.operation != OP_FX0A) {
+      slot->done = 1;
+      break;
+    }
+  }
+  if (env->done_address >= 0 && chip8_read(chip8, env->done_address) != 0) {
+    slot->done = 1;
+  }
+
+  for (uint32_t r = 0; r < env->header->num_rewards; r++) {
+    uint8_t value = chip8_read(chip8, env->reward_addresses[r]);
+    slot->reward[r] = value - instance->reward_prev[r];
+    instance->reward_prev[r] = value;
+  }
+  vecenv_publish(env, n, chip8);
+}
+
+void *vecenv_worker(void *arg) {
+  struct vecenv_worker *worker = arg;
+  struct vecenv *env = worker->env;
+  struct vecenv_header *header = env->header;
+
+  uint32_t seen = 0;
+  for (;;) {
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&header->step_seq, __ATOMIC_ACQUIRE)) == seen) {
+      futex_wait(&header->step_seq, seen);
+    }
+    seen = seq;
+    if (__atomic_load_n(&header->shutdown, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+
+    for (uint32_t n = worker->first; n < worker->last; n++) {
+      vecenv_step(env, n);
+    }
+
+    // the last worker to finish publishes the step
+    if (__atomic_add_fetch(&env->workers_finished, 1, __ATOMIC_ACQ_REL) == (uint32_t)env->num_threads) {
+      env->workers_finished = 0;
+      __atomic_store_n(&header->done_seq, seq, __ATOMIC_RELEASE);
+      futex_wake(&header->done_seq);
+    }
+  }
+  return NULL;
+}
+
+void usage(void) {
+  fprintf(stderr, "usage: vecenv [-n envs] [-t threads] [-c cycles per step] [-r reward address]... [-d done address] [-s seed] [-m] program\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  struct vecenv env = {0};
+  uint32_t num_envs = 1;
+  uint32_t num_rewards = 0;
+  env.num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  env.cycles_per_step = 30;
+  env.done_address = -1;
+  env.seed = CHIP8_RAND_SEED;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:t:c:r:d:s:m")) != -1) {
+    switch (opt) {
+      case 'n':
+        num_envs = strtoul(optarg, NULL, 0);
+        break;
+      case 't':
+        env.num_threads = strtol(optarg, NULL, 0);
+        break;
+      case 'c':
+        env.cycles_per_step = strtol(optarg, NULL, 0);
+        break;
+      case 'r':
+        if (num_rewards == VECENV_MAX_REWARDS) {
+          usage();
+        }
+        env.reward_addresses[num_rewards++] = strtoul(optarg, NULL, 0) & (CHIP8_MEMORY_SIZE - 1);
+        break;
+      case 'd':
+        env.done_address = strtoul(optarg, NULL, 0) & (CHIP8_MEMORY_SIZE - 1);
+        break;
+      case 's':
+        env.seed = strtoul(optarg, NULL, 0);
+        break;
+      case 'm':
+        env.mirror_memory = true;
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind >= argc || num_envs == 0) {
+    usage();
+  }
+  if (env.num_threads < 1) {
+    env.num_threads = 1;
+  }
+  if (env.num_threads > VECENV_MAX_THREADS) {
+    env.num_threads = VECENV_MAX_THREADS;
+  }
+  if ((uint32_t)env.num_threads > num_envs) {
+    env.num_threads = num_envs;
+  }
+
+  chip8_image_init(&env.image);
+  // load the ROM
+  read_file(argv[optind], &env.image.memory[PROGRAM_START_ADDRESS], (sizeof env.image.memory) - PROGRAM_START_ADDRESS);
+  chip8_init(&env.initial, &env.image);
+
+  size_t slot_offset = (sizeof(struct vecenv_header) + VECENV_SLOT_ALIGN - 1) & ~(size_t)(VECENV_SLOT_ALIGN - 1);
+  size_t slot_size = sizeof(struct vecenv_slot) + (env.mirror_memory ? CHIP8_MEMORY_SIZE : 0);
+  slot_size = (slot_size + VECENV_SLOT_ALIGN - 1) & ~(size_t)(VECENV_SLOT_ALIGN - 1);
+  size_t region_size = slot_offset + slot_size * num_envs;
+
+  int fd = memfd_create("chip8-vecenv", 0);
+  if (fd == -1) {
+    die("memfd_create");
+  }
+  if (ftruncate(fd, region_size) == -1) {
+    die("ftruncate");
+  }
+  uint8_t *region = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (region == MAP_FAILED) {
+    die("mmap");
+  }
+
+  env.header = (struct vecenv_header *)region;
+  env.slots = region + slot_offset;
+  env.header->num_envs = num_envs;
+  env.header->num_rewards = num_rewards;
+  env.header->slot_offset = slot_offset;
+  env.header->slot_size = slot_size;
+  env.header->display_offset = offsetof(struct vecenv_slot, display);
+  env.header->memory_offset = env.mirror_memory ? sizeof(struct vecenv_slot) : 0;
+  env.instances = calloc(num_envs, sizeof *env.instances);
+  if (env.instances == NULL) {
+    die("calloc");
+  }
+  for (uint32_t n = 0; n < num_envs; n++) {
+    env.instances[n].chip8 = env.initial;
+    // xorshift gets stuck at 0
+    uint32_t seed = env.seed + n * 0x9e3779b9u;
+    env.instances[n].chip8.rand_state = seed != 0 ? seed : CHIP8_RAND_SEED;
+    vecenv_reset(&env, n);
+  }
+  env.header->version = VECENV_VERSION;
+  __atomic_store_n(&env.header->magic, VECENV_MAGIC, __ATOMIC_RELEASE);
+
+  // controllers open this path to map the region
+  printf("/proc/%d/fd/%d\n", getpid(), fd);
+  fflush(stdout);
+
+  pthread_t threads[VECENV_MAX_THREADS];
+  struct vecenv_worker workers[VECENV_MAX_THREADS];
+  uint32_t per_thread = num_envs / env.num_threads;
+  uint32_t remainder = num_envs % env.num_threads;
+  uint32_t first = 0;
+  for (int t = 0; t < env.num_threads; t++) {
+    workers[t].env = &env;
+    workers[t].first = first;
+    workers[t].last = first + per_thread + ((uint32_t)t < remainder);
+    first = workers[t].last;
+    if (pthread_create(&threads[t], NULL, vecenv_worker, &workers[t]) != 0) {
+      die("pthread_create");
+    }
+  }
+  for (int t = 0; t < env.num_threads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  for (uint32_t n = 0; n < num_envs; n++) {
+    chip8_free(&env.instances[n].chip8);
+  }
+  free(env.instances);
+  munmap(region, region_size);
+  close(fd);
+  return 0;
+}